@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+
+namespace rtkcommunication
+
+{
+	/**
+	 * @brief Bounded lock-free multi-producer multi-consumer queue, whose implementation is based on https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue.
+	 * Every slot carries a sequence number telling producers and consumers whose turn it is, so a push or pop is a single CAS on the head or tail index.
+	 */
+	template<typename T>
+	class MpmcQueue
+	{
+
+	public:
+		/**
+		 * @brief Construct the queue. Capacity is rounded up to a power of two.
+		 */
+		explicit MpmcQueue(const size_t capacity)
+		{
+			size_t rounded_capacity = 2;
+			while (rounded_capacity < capacity)
+				rounded_capacity <<= 1;
+
+			slots = std::make_unique<Slot[]>(rounded_capacity);
+			mask = rounded_capacity - 1;
+
+			for (size_t i = 0; i < rounded_capacity; i++)
+				slots[i].sequence.store(i, std::memory_order_relaxed);
+
+			head.store(0, std::memory_order_relaxed);
+			tail.store(0, std::memory_order_relaxed);
+		}
+
+
+		/**
+		 * @brief Push a value. Returns false if the queue is full, in which case 'value' is left untouched.
+		 */
+		bool TryPush(T&& value)
+		{
+			size_t position = head.load(std::memory_order_relaxed);
+			Slot* slot;
+
+			while (true)
+			{
+				slot = &slots[position & mask];
+				size_t sequence = slot->sequence.load(std::memory_order_acquire);
+				intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+				if (difference == 0)
+				{
+					if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed) == true)
+						break;
+				}
+				else if (difference < 0)
+				{
+					return false;
+				}
+				else
+				{
+					position = head.load(std::memory_order_relaxed);
+				}
+			}
+
+			slot->value = std::move(value);
+			slot->sequence.store(position + 1, std::memory_order_release);
+
+			return true;
+		}
+
+
+		/**
+		 * @brief Pop a value. Returns false if the queue is empty.
+		 */
+		bool TryPop(T& value)
+		{
+			size_t position = tail.load(std::memory_order_relaxed);
+			Slot* slot;
+
+			while (true)
+			{
+				slot = &slots[position & mask];
+				size_t sequence = slot->sequence.load(std::memory_order_acquire);
+				intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+
+				if (difference == 0)
+				{
+					if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed) == true)
+						break;
+				}
+				else if (difference < 0)
+				{
+					return false;
+				}
+				else
+				{
+					position = tail.load(std::memory_order_relaxed);
+				}
+			}
+
+			value = std::move(slot->value);
+			slot->value = T();
+			slot->sequence.store(position + mask + 1, std::memory_order_release);
+
+			return true;
+		}
+
+
+		size_t Capacity() const
+		{
+			return mask + 1;
+		}
+
+
+	private:
+		MpmcQueue(const MpmcQueue&) = delete;
+		MpmcQueue& operator=(const MpmcQueue&) = delete;
+
+		struct alignas(64) Slot
+		{
+			std::atomic<size_t> sequence;
+			T value;
+		};
+
+		std::unique_ptr<Slot[]> slots;
+		size_t mask;
+
+		// Producers and consumers touch different cache lines
+		alignas(64) std::atomic<size_t> head;
+		alignas(64) std::atomic<size_t> tail;
+	};
+}
\ No newline at end of file
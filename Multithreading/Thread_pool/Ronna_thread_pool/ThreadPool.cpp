@@ -1,76 +1,599 @@
 #include "rtkcommunication/Common/ThreadPool.h"
 
+#include <cerrno>
+#include <climits>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 using namespace rtkcommunication;
 
 
-ThreadPool::ThreadPool(const int num_of_workers)
+namespace
 {
-	workers_vec.reserve(num_of_workers);
-	should_stop = false;
+	// Time an idle worker spins before it parks. A pause instruction takes anywhere from ~10 to ~140 cycles depending on the CPU,
+	// so the spin is bounded by the clock, which is read every SPIN_CHECK_INTERVAL pauses
+	constexpr std::chrono::microseconds SPIN_DURATION(10);
+	constexpr int SPIN_CHECK_INTERVAL = 16;
 
-	try
+	// States of Worker::start_state
+	constexpr uint32_t WORKER_STARTING = 0;
+	constexpr uint32_t WORKER_STARTED = 1;
+	constexpr uint32_t WORKER_ABORTED = 2;
+
+	// Pool whose worker is the calling thread, so that tasks can still submit follow-up work while the pool drains
+	thread_local const ThreadPool* current_pool = nullptr;
+
+	// Linux limits thread names to 16 bytes including the terminating null character
+	constexpr size_t MAX_THREAD_NAME_LENGTH = 15;
+
+	// Counters are written by a single worker, so a relaxed load and store is enough and avoids a locked instruction
+	inline void IncrementCounter(std::atomic<uint64_t>& counter, const uint64_t value = 1)
 	{
-		for (int i = 0; i < num_of_workers; i++)
-			workers_vec.emplace_back(&ThreadPool::WorkerFunction, this);
+		counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
 	}
-	catch (...)
+
+
+	inline size_t GetHistogramBucket(const uint64_t nanoseconds)
+	{
+		if (nanoseconds == 0)
+			return 0;
+
+		size_t bucket = 63 - __builtin_clzll(nanoseconds);
+
+		return bucket < THREAD_POOL_HISTOGRAM_BUCKETS ? bucket : THREAD_POOL_HISTOGRAM_BUCKETS - 1;
+	}
+
+
+	static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be a plain 32-bit integer");
+
+
+	inline void CpuRelax()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		_mm_pause();
+#elif defined(__aarch64__)
+		asm volatile("yield" ::: "memory");
+#else
+		std::this_thread::yield();
+#endif
+	}
+
+
+	// Returns true if the wait timed out; zero 'timeout' waits without a time limit
+	bool FutexWait(std::atomic<uint32_t>& word, uint32_t expected, const std::chrono::milliseconds timeout)
 	{
+		if (timeout == std::chrono::milliseconds::zero())
 		{
-			std::lock_guard<std::mutex> lock(queue_mutex);
-			should_stop = true;
+			syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+			return false;
 		}
 
-		cond_variable.notify_all();
+		timespec relative_timeout;
+		relative_timeout.tv_sec = timeout.count() / 1000;
+		relative_timeout.tv_nsec = (timeout.count() % 1000) * 1000000;
+
+		return syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, &relative_timeout, nullptr, 0) == -1 && errno == ETIMEDOUT;
+	}
+
+
+	void FutexWake(std::atomic<uint32_t>& word, int num_of_waiters)
+	{
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, num_of_waiters, nullptr, nullptr, 0);
+	}
+}
+
+
+ThreadPool::ThreadPool(const int num_of_workers)
+	: spawned_workers(0),
+	live_workers(0),
+	blocked_workers(0),
+	should_stop(false),
+	is_worker_requested(false),
+	tasks_queue(Config().queue_capacity),
+	overflow_size(0),
+	queue_high_water_mark(0),
+	is_accepting(true),
+	is_draining(false),
+	unfinished_tasks(0),
+	pending_tasks(0),
+	dequeued_tasks(0),
+	searching_workers(0),
+	sleeping_workers(0),
+	wake_epoch(0),
+	should_stop_stats_dump(false)
+{
+	Config config;
+	config.num_of_workers = num_of_workers;
+
+	Start(config);
+}
+
+
+ThreadPool::ThreadPool(const Config& config)
+	: spawned_workers(0),
+	live_workers(0),
+	blocked_workers(0),
+	should_stop(false),
+	is_worker_requested(false),
+	tasks_queue(config.queue_capacity),
+	overflow_size(0),
+	queue_high_water_mark(0),
+	is_accepting(true),
+	is_draining(false),
+	unfinished_tasks(0),
+	pending_tasks(0),
+	dequeued_tasks(0),
+	searching_workers(0),
+	sleeping_workers(0),
+	wake_epoch(0),
+	should_stop_stats_dump(false)
+{
+	Start(config);
+}
+
+
+ThreadPool::~ThreadPool()
+{
+	StopStatsDump();
+	Shutdown(ShutdownMode::Drain);
+}
+
+
+void ThreadPool::Shutdown(const ShutdownMode mode)
+{
+	std::lock_guard<std::mutex> shutdown_lock(shutdown_mutex);
 
-		for (std::thread& worker : workers_vec)
+	is_draining = mode == ShutdownMode::Drain;
+	is_accepting = false;
+
+	if (mode == ShutdownMode::Discard)
+	{
+		// Destroying the tasks breaks their promises
+		Task task;
+		while (TryDequeue(task) == true)
 		{
-			if (worker.joinable() == true)
-				worker.join();
+			task = Task();
+			FinishTask();
 		}
+	}
+
+	// Also waits for producers that passed the 'is_accepting' check just before it was cleared, so that no task is left in the queue
+	WaitIdle();
+
+	// Nothing is running anymore, so no worker can submit
+	is_draining = false;
+
+	StopWorkers();
+}
+
+
+void ThreadPool::WaitIdle()
+{
+	std::unique_lock<std::mutex> lock(idle_mutex);
+	idle_cond_variable.wait(lock, [this]() { return unfinished_tasks == 0; });
+}
+
+
+void ThreadPool::Push(Task&& task)
+{
+	// Counting the task before checking the flag pairs with Shutdown(), which clears the flag before waiting for the count to drop.
+	// A task submitted from a worker during a drain is accepted - the submitting task is still unfinished, so the drain cannot have ended
+	unfinished_tasks++;
+
+	if (is_accepting == false && (is_draining == false || current_pool != this))
+	{
+		FinishTask();
+		throw std::runtime_error("Enqueue on a ThreadPool that was shut down");
+	}
+
+	size_t queue_depth = ++pending_tasks;
+
+	size_t high_water_mark = queue_high_water_mark.load(std::memory_order_relaxed);
+	while (queue_depth > high_water_mark && queue_high_water_mark.compare_exchange_weak(high_water_mark, queue_depth, std::memory_order_relaxed) == false)
+	{
+	}
+
+	if (tasks_queue.TryPush(std::move(task)) == false)
+	{
+		std::lock_guard<std::mutex> lock(overflow_mutex);
+		overflow_queue.push_back(std::move(task));
+		overflow_size++;
+	}
+
+	WakeWorker();
+}
+
+
+void ThreadPool::FinishTask()
+{
+	if (unfinished_tasks.fetch_sub(1) == 1)
+	{
+		// Notifying under the lock prevents a lost wakeup between the predicate check and the wait in WaitIdle()
+		std::lock_guard<std::mutex> lock(idle_mutex);
+		idle_cond_variable.notify_all();
+	}
+}
+
+
+void ThreadPool::Start(const Config& config)
+{
+	pool_config = config;
+
+	if (pool_config.num_of_workers <= 0)
+		pool_config.num_of_workers = pool_config.cpu_set.empty() == true ? GetNumberOfHardwareThreads() : static_cast<int>(pool_config.cpu_set.size());
 
+	if (pool_config.min_workers <= 0 || pool_config.min_workers > pool_config.num_of_workers)
+		pool_config.min_workers = pool_config.num_of_workers;
+
+	if (pool_config.max_workers < pool_config.num_of_workers)
+		pool_config.max_workers = pool_config.num_of_workers;
+
+	workers_vec.reserve(pool_config.max_workers);
+
+	try
+	{
+		std::lock_guard<std::mutex> lock(workers_mutex);
+
+		for (int i = 0; i < pool_config.num_of_workers; i++)
+			SpawnWorker();
+	}
+	catch (...)
+	{
+		StopWorkers();
 		throw;
 	}
+
+	if (pool_config.max_workers > pool_config.min_workers)
+		supervisor_thread = std::thread(&ThreadPool::SupervisorFunction, this);
 }
 
 
-ThreadPool::~ThreadPool()
+void ThreadPool::StopWorkers()
 {
 	{
-		std::lock_guard<std::mutex> lock(queue_mutex);
+		// Under the lock, so that no worker can be spawned after this point
+		std::lock_guard<std::mutex> lock(workers_mutex);
 		should_stop = true;
 	}
 
-	cond_variable.notify_all();
+	wake_epoch++;
+	FutexWake(wake_epoch, INT_MAX);
+
+	supervisor_cond_variable.notify_all();
+
+	if (supervisor_thread.joinable() == true)
+		supervisor_thread.join();
+
+	for (std::unique_ptr<Worker>& worker : workers_vec)
+	{
+		if (worker->thread.joinable() == true)
+			worker->thread.join();
+	}
+}
+
+
+void ThreadPool::SpawnWorker()
+{
+	int index = spawned_workers;
+
+	workers_vec.push_back(std::make_unique<Worker>());
+	Worker& worker = *workers_vec.back();
+	worker.counters.start_time = std::chrono::steady_clock::now();
 
-	for (std::thread& worker : workers_vec)
+	try
 	{
-		if (worker.joinable() == true)
-			worker.join();
+		worker.thread = std::thread([this, &worker]()
+		{
+			// Held back until the thread is pinned, so that no task runs on the wrong CPU
+			while (worker.start_state == WORKER_STARTING)
+				FutexWait(worker.start_state, WORKER_STARTING, std::chrono::milliseconds::zero());
+
+			if (worker.start_state == WORKER_STARTED)
+				WorkerFunction(worker);
+		});
 	}
+	catch (...)
+	{
+		workers_vec.pop_back();
+		throw;
+	}
+
+	// Affinity and name are applied from here rather than from the worker, so that a failure is reported to the caller
+	if (pool_config.cpu_set.empty() == false)
+	{
+		int cpu = pool_config.cpu_set[index % pool_config.cpu_set.size()];
+
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+
+		int result = pthread_setaffinity_np(worker.thread.native_handle(), sizeof(cpus), &cpus);
+		if (result != 0)
+		{
+			worker.start_state = WORKER_ABORTED;
+			FutexWake(worker.start_state, 1);
+			worker.thread.join();
+			workers_vec.pop_back();
+
+			throw std::system_error(result, std::generic_category(), "Pinning thread pool worker to CPU " + std::to_string(cpu) + " failed");
+		}
+	}
+
+	std::string suffix = "-" + std::to_string(index);
+	std::string thread_name = pool_config.name.substr(0, MAX_THREAD_NAME_LENGTH - suffix.size()) + suffix;
+	pthread_setname_np(worker.thread.native_handle(), thread_name.c_str());
+
+	spawned_workers++;
+	live_workers++;
+
+	worker.start_state = WORKER_STARTED;
+	FutexWake(worker.start_state, 1);
 }
 
 
-void ThreadPool::WorkerFunction() {
+void ThreadPool::TrySpawnWorker()
+{
+	std::lock_guard<std::mutex> lock(workers_mutex);
+
+	// StopWorkers() joins 'workers_vec' without the lock once 'should_stop' is set, so it must not be modified anymore
+	if (should_stop == true)
+		return;
+
+	ReapRetiredWorkers();
+
+	if (live_workers >= pool_config.max_workers)
+		return;
+
+	// On purpose: an extra worker only helps with the load, SpawnWorker() leaves nothing behind if it fails
+	try
+	{
+		SpawnWorker();
+	}
+	catch (...)
+	{
+	}
+}
+
+
+void ThreadPool::RequestWorker()
+{
+	// Requests coalesce until the supervisor takes them, each one spawns at most one worker
+	if (is_worker_requested.exchange(true) == true)
+		return;
+
+	// Taking the lock orders the flag with the supervisor's check of it, so the notification can't get lost in between
+	{
+		std::lock_guard<std::mutex> lock(supervisor_mutex);
+	}
+
+	supervisor_cond_variable.notify_one();
+}
+
+
+void ThreadPool::ReapRetiredWorkers()
+{
+	for (auto it = workers_vec.begin(); it != workers_vec.end();)
+	{
+		Worker& worker = **it;
+
+		if (worker.has_exited == false)
+		{
+			it++;
+			continue;
+		}
+
+		worker.thread.join();
+
+		IncrementCounter(retired_counters.tasks_executed, worker.counters.tasks_executed);
+		IncrementCounter(retired_counters.busy_ns, worker.counters.busy_ns);
+
+		for (size_t i = 0; i < THREAD_POOL_HISTOGRAM_BUCKETS; i++)
+		{
+			IncrementCounter(retired_counters.queue_wait_histogram[i], worker.counters.queue_wait_histogram[i]);
+			IncrementCounter(retired_counters.run_time_histogram[i], worker.counters.run_time_histogram[i]);
+		}
+
+		it = workers_vec.erase(it);
+	}
+}
+
+
+void ThreadPool::SupervisorFunction()
+{
+	uint64_t last_dequeued_tasks = dequeued_tasks;
+	bool was_pending = false;
+
+	std::unique_lock<std::mutex> lock(supervisor_mutex);
+
 	while (true)
 	{
-		std::function<void()> task;
+		bool is_woken = supervisor_cond_variable.wait_for(lock, pool_config.spawn_threshold, [this]() { return should_stop.load() || is_worker_requested.load(); });
+
+		if (should_stop == true)
+			return;
+
+		// Asked by a worker or a blocking region, which leave spawning and joining threads to this one
+		if (is_woken == true)
+		{
+			is_worker_requested = false;
+			TrySpawnWorker();
+			continue;
+		}
 
+		// Tasks were queued during the whole last period and none was picked up, so every worker is busy or blocked
+		bool is_pending = pending_tasks > 0;
+		bool is_stalled = was_pending == true && is_pending == true && dequeued_tasks == last_dequeued_tasks;
+
+		last_dequeued_tasks = dequeued_tasks;
+		was_pending = is_pending;
+
+		if (is_stalled == true)
+		{
+			TrySpawnWorker();
+		}
+		else
 		{
-			std::unique_lock<std::mutex> lock(queue_mutex);
+			std::lock_guard<std::mutex> workers_lock(workers_mutex);
+			ReapRetiredWorkers();
+		}
+	}
+}
+
+
+void ThreadPool::WorkerFunction(Worker& worker) {
+	WorkerCounters& counters = worker.counters;
+	Task task;
 
-			while (tasks_queue.empty() == true)
+	current_pool = this;
+
+	while (true)
+	{
+		if (TryDequeue(task) == true)
+		{
+			// Cancelled before it started - drop it without running, which breaks its promise
+			if (task.is_cancelled != nullptr && task.is_cancelled->load(std::memory_order_relaxed) == true)
 			{
-				if (should_stop == true)
-					return;
+				task = Task();
+				FinishTask();
+				continue;
+			}
 
-				cond_variable.wait(lock);
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+			// The task waited too long and nobody is idle, so the pool is saturated - grow before running it
+			if (start - task.enqueue_time > pool_config.spawn_threshold && live_workers < pool_config.max_workers
+				&& pending_tasks > 0 && searching_workers == 0 && sleeping_workers == 0)
+			{
+				RequestWorker();
 			}
 
-			task = std::move(tasks_queue.front());
-			tasks_queue.pop();
+			task.function();
+			std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+			uint64_t wait_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(start - task.enqueue_time).count();
+			uint64_t run_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+			task = Task();
+
+			IncrementCounter(counters.tasks_executed);
+			IncrementCounter(counters.busy_ns, run_ns);
+			IncrementCounter(counters.queue_wait_histogram[GetHistogramBucket(wait_ns)]);
+			IncrementCounter(counters.run_time_histogram[GetHistogramBucket(run_ns)]);
+
+			FinishTask();
+			continue;
+		}
+
+		// Queue is drained, so the pool can finish
+		if (should_stop == true)
+			return;
+
+		if (WaitForTask() == false)
+		{
+			worker.has_exited = true;
+			return;
+		}
+	}
+}
+
+
+bool ThreadPool::TryDequeue(Task& task)
+{
+	if (pending_tasks.load(std::memory_order_relaxed) == 0)
+		return false;
+
+	if (tasks_queue.TryPop(task) == false)
+	{
+		if (overflow_size.load(std::memory_order_relaxed) == 0)
+			return false;
+
+		std::lock_guard<std::mutex> lock(overflow_mutex);
+
+		if (overflow_queue.empty() == true)
+			return false;
+
+		task = std::move(overflow_queue.front());
+		overflow_queue.pop_front();
+		overflow_size--;
+	}
+
+	pending_tasks--;
+	dequeued_tasks.fetch_add(1, std::memory_order_relaxed);
+
+	return true;
+}
+
+
+bool ThreadPool::WaitForTask()
+{
+	searching_workers++;
+
+	std::chrono::steady_clock::time_point spin_end = std::chrono::steady_clock::now() + SPIN_DURATION;
+
+	for (int i = 1; ; i++)
+	{
+		if (pending_tasks.load(std::memory_order_relaxed) > 0 || should_stop.load(std::memory_order_relaxed) == true)
+		{
+			// The last searcher leaving with more work queued hands the search over to a parked worker,
+			// because submitters did not wake anyone while we were spinning
+			if (searching_workers.fetch_sub(1) == 1 && pending_tasks > 1)
+				WakeWorker();
+
+			return true;
 		}
 
-		task();
+		CpuRelax();
+
+		if (i % SPIN_CHECK_INTERVAL == 0 && std::chrono::steady_clock::now() >= spin_end)
+			break;
+	}
+
+	// Register as a sleeper before re-checking the queue, so a concurrent Enqueue either sees us
+	// sleeping (and wakes us) or we see its task (and do not park)
+	uint32_t epoch = wake_epoch;
+	sleeping_workers++;
+	searching_workers--;
+
+	bool is_elastic = pool_config.max_workers > pool_config.min_workers;
+	bool has_timed_out = false;
+
+	if (pending_tasks == 0 && should_stop == false)
+		has_timed_out = FutexWait(wake_epoch, epoch, is_elastic == true ? pool_config.idle_timeout : std::chrono::milliseconds::zero());
+
+	// Unregister before the final queue check, so a concurrent Enqueue does not count on this worker
+	sleeping_workers--;
+
+	if (has_timed_out == false || pending_tasks > 0 || should_stop == true)
+		return true;
+
+	int num_of_workers = live_workers;
+	while (num_of_workers > pool_config.min_workers)
+	{
+		if (live_workers.compare_exchange_weak(num_of_workers, num_of_workers - 1) == true)
+			return false;
+	}
+
+	return true;
+}
+
+
+void ThreadPool::WakeWorker()
+{
+	if (searching_workers == 0 && sleeping_workers > 0)
+	{
+		wake_epoch++;
+		FutexWake(wake_epoch, 1);
 	}
 }
 
@@ -83,4 +606,218 @@ int ThreadPool::GetNumberOfHardwareThreads()
 		return detected_num_of_threads;
 	else
 		return 1;
+}
+
+
+std::vector<int> ThreadPool::GetAvailableCpus()
+{
+	std::vector<int> cpus;
+
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+	{
+		for (int i = 0; i < GetNumberOfHardwareThreads(); i++)
+			cpus.push_back(i);
+
+		return cpus;
+	}
+
+	for (int i = 0; i < CPU_SETSIZE; i++)
+	{
+		if (CPU_ISSET(i, &allowed))
+			cpus.push_back(i);
+	}
+
+	return cpus;
+}
+
+
+std::vector<std::vector<int>> ThreadPool::GetDisjointCpuGroups(const int num_of_groups)
+{
+	std::vector<int> cpus = GetAvailableCpus();
+
+	if (num_of_groups <= 0 || static_cast<size_t>(num_of_groups) > cpus.size())
+		throw std::invalid_argument("Cannot split " + std::to_string(cpus.size()) + " CPUs into " + std::to_string(num_of_groups) + " groups");
+
+	std::vector<std::vector<int>> groups(num_of_groups);
+
+	// Contiguous ranges keep every group on neighbouring cores, which usually share the last level cache;
+	// the first 'remainder' groups get one CPU more
+	size_t group_size = cpus.size() / num_of_groups;
+	size_t remainder = cpus.size() % num_of_groups;
+	size_t index = 0;
+
+	for (size_t group = 0; group < groups.size(); group++)
+	{
+		size_t size = group_size + (group < remainder ? 1 : 0);
+		groups[group].assign(cpus.begin() + index, cpus.begin() + index + size);
+		index += size;
+	}
+
+	return groups;
+}
+
+
+ThreadPool::BlockingRegion::BlockingRegion(ThreadPool& pool)
+	: pool(pool)
+{
+	int num_of_blocked_workers = ++pool.blocked_workers;
+
+	if (pool.live_workers - num_of_blocked_workers < pool.pool_config.num_of_workers && pool.live_workers < pool.pool_config.max_workers)
+		pool.RequestWorker();
+}
+
+
+ThreadPool::BlockingRegion::~BlockingRegion()
+{
+	// Surplus workers spawned for compensation retire on their own after 'idle_timeout'
+	pool.blocked_workers--;
+}
+
+
+ThreadPool::PoolStats ThreadPool::Stats() const
+{
+	PoolStats stats{};
+	stats.num_of_blocked_workers = blocked_workers;
+	stats.queue_depth = pending_tasks;
+	stats.queue_high_water_mark = queue_high_water_mark;
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	std::lock_guard<std::mutex> lock(workers_mutex);
+
+	stats.tasks_executed = retired_counters.tasks_executed;
+
+	for (size_t i = 0; i < THREAD_POOL_HISTOGRAM_BUCKETS; i++)
+	{
+		stats.queue_wait_histogram[i] = retired_counters.queue_wait_histogram[i];
+		stats.run_time_histogram[i] = retired_counters.run_time_histogram[i];
+	}
+
+	for (const std::unique_ptr<Worker>& worker : workers_vec)
+	{
+		if (worker->has_exited == true)
+			continue;
+
+		const WorkerCounters* counters = &worker->counters;
+
+		WorkerStats worker_stats;
+		worker_stats.tasks_executed = counters->tasks_executed.load(std::memory_order_relaxed);
+
+		uint64_t lifetime_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - counters->start_time).count();
+		worker_stats.busy_ratio = lifetime_ns > 0 ? (double)counters->busy_ns.load(std::memory_order_relaxed) / (double)lifetime_ns : 0.0;
+
+		stats.workers.push_back(worker_stats);
+		stats.num_of_workers++;
+		stats.tasks_executed += worker_stats.tasks_executed;
+
+		for (size_t i = 0; i < THREAD_POOL_HISTOGRAM_BUCKETS; i++)
+		{
+			stats.queue_wait_histogram[i] += counters->queue_wait_histogram[i].load(std::memory_order_relaxed);
+			stats.run_time_histogram[i] += counters->run_time_histogram[i].load(std::memory_order_relaxed);
+		}
+	}
+
+	return stats;
+}
+
+
+void ThreadPool::StartStatsDump(const std::chrono::milliseconds period, std::function<void(const PoolStats&)> callback)
+{
+	StopStatsDump();
+
+	if (callback == nullptr)
+		throw std::invalid_argument("Stats dump needs a callback");
+
+	should_stop_stats_dump = false;
+
+	stats_dump_thread = std::thread([this, period, callback]()
+	{
+		std::unique_lock<std::mutex> lock(stats_dump_mutex);
+
+		while (stats_dump_cond_variable.wait_for(lock, period, [this]() { return should_stop_stats_dump; }) == false)
+		{
+			lock.unlock();
+			callback(Stats());
+			lock.lock();
+		}
+	});
+}
+
+
+void ThreadPool::StopStatsDump()
+{
+	{
+		std::lock_guard<std::mutex> lock(stats_dump_mutex);
+		should_stop_stats_dump = true;
+	}
+
+	stats_dump_cond_variable.notify_all();
+
+	if (stats_dump_thread.joinable() == true)
+		stats_dump_thread.join();
+}
+
+
+uint64_t ThreadPool::PoolStats::Percentile(const Histogram& histogram, const double percentile)
+{
+	uint64_t total = 0;
+	for (uint64_t count : histogram)
+		total += count;
+
+	if (total == 0)
+		return 0;
+
+	uint64_t threshold = (uint64_t)(percentile / 100.0 * (double)total);
+	uint64_t accumulated = 0;
+
+	for (size_t i = 0; i < histogram.size(); i++)
+	{
+		accumulated += histogram[i];
+
+		if (accumulated > threshold || accumulated == total)
+			return 2ULL << i;
+	}
+
+	return 2ULL << (histogram.size() - 1);
+}
+
+
+std::string ThreadPool::PoolStats::ToString() const
+{
+	std::ostringstream stream;
+
+	stream << num_of_workers << " workers (" << num_of_blocked_workers << " blocked), "
+		<< "queue depth " << queue_depth << " (high water " << queue_high_water_mark << "), "
+		<< tasks_executed << " tasks, "
+		<< "wait p50/p99 " << Percentile(queue_wait_histogram, 50) << "/" << Percentile(queue_wait_histogram, 99) << " ns, "
+		<< "run p50/p99 " << Percentile(run_time_histogram, 50) << "/" << Percentile(run_time_histogram, 99) << " ns, "
+		<< "busy [";
+
+	for (size_t i = 0; i < workers.size(); i++)
+		stream << (i > 0 ? " " : "") << (int)(workers[i].busy_ratio * 100) << "%";
+
+	stream << "]";
+
+	return stream.str();
+}
+
+
+CancellationToken::CancellationToken()
+	: is_cancelled(std::make_shared<std::atomic<bool>>(false))
+{
+}
+
+
+void CancellationToken::Cancel()
+{
+	is_cancelled->store(true, std::memory_order_relaxed);
+}
+
+
+bool CancellationToken::IsCancelled() const
+{
+	return is_cancelled->load(std::memory_order_relaxed);
 }
\ No newline at end of file
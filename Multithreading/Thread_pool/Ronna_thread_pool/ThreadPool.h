@@ -1,13 +1,47 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <functional>
 #include <future>
-#include <queue>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rtkcommunication/Common/MpmcQueue.h"
+
+#define THREAD_POOL_HISTOGRAM_BUCKETS 32
 
 
 namespace rtkcommunication
 
 {
+	/**
+	 * @brief Cooperative cancellation flag shared by all of its copies. Tasks submitted with ThreadPool::EnqueueCancellable() that have not started yet
+	 * are dropped without running once the token is cancelled; tasks already running can poll IsCancelled() and return early.
+	 */
+	class CancellationToken
+	{
+
+	public:
+		CancellationToken();
+
+		void Cancel();
+		bool IsCancelled() const;
+
+	private:
+		friend class ThreadPool;
+
+		std::shared_ptr<std::atomic<bool>> is_cancelled;
+	};
+
+
 	/**
 	 * @brief Class for using the thread pooling, whose implementation is based on https://codereview.stackexchange.com/questions/275834/tiny-thread-pool-implementation.
 	 */
@@ -15,12 +49,204 @@ namespace rtkcommunication
 	{
 
 	public:
+		/**
+		 * @brief Construction parameters of the pool.
+		 */
+		struct Config
+		{
+			// Number of workers; 0 means one worker per CPU in 'cpu_set', or one per hardware thread if 'cpu_set' is empty
+			int num_of_workers = 0;
+
+			// Elastic bounds of the worker count; 0 means 'num_of_workers', so by default the pool has a fixed size
+			int min_workers = 0;
+			int max_workers = 0;
+
+			// An extra worker is spawned when the queue has not made progress for this long
+			std::chrono::milliseconds spawn_threshold{ 5 };
+
+			// A worker above 'min_workers' retires after being parked for this long
+			std::chrono::milliseconds idle_timeout{ 10000 };
+
+			// Slots of the lock-free submission queue (rounded up to a power of two, 64 bytes each, allocated up front);
+			// tasks beyond it go to a locked overflow queue, so bursts do not need a large queue
+			size_t queue_capacity = 1024;
+
+			// CPUs the workers are pinned to (worker i runs on cpu_set[i % cpu_set.size()]); empty means unpinned
+			std::vector<int> cpu_set;
+
+			// Thread name prefix visible in top/perf/gdb, workers are named "<name>-<index>" (truncated to 15 characters)
+			std::string name = "rtkpool";
+		};
+
+		/**
+		 * @brief Logarithmic latency histogram: bucket i counts samples that took [2^i, 2^(i+1)) nanoseconds, the last bucket also counts everything longer.
+		 */
+		typedef std::array<uint64_t, THREAD_POOL_HISTOGRAM_BUCKETS> Histogram;
+
+		struct WorkerStats
+		{
+			uint64_t tasks_executed;
+
+			// Fraction of the worker's lifetime spent running tasks
+			double busy_ratio;
+		};
+
+		/**
+		 * @brief Snapshot of the pool telemetry returned by Stats().
+		 */
+		struct PoolStats
+		{
+			size_t num_of_workers;
+			size_t num_of_blocked_workers;
+			size_t queue_depth;
+			size_t queue_high_water_mark;
+			// Includes tasks executed by workers that have since retired
+			uint64_t tasks_executed;
+
+			// Time from Enqueue until a worker picked the task up
+			Histogram queue_wait_histogram;
+
+			// Time spent executing the task
+			Histogram run_time_histogram;
+
+			// Currently running workers only
+			std::vector<WorkerStats> workers;
+
+			/**
+			 * @brief Get the upper bound in nanoseconds of the histogram bucket containing the given percentile (0 - 100).
+			 */
+			static uint64_t Percentile(const Histogram& histogram, const double percentile);
+
+			std::string ToString() const;
+		};
+
+		/**
+		 * @brief RAII hint that the calling task is about to block (disk, libusb, network). While the region is alive, the blocked worker
+		 * is not counted as available and an elastic pool spawns a replacement (up to 'max_workers'), so CPU-bound tasks keep running.
+		 */
+		class BlockingRegion
+		{
+
+		public:
+			explicit BlockingRegion(ThreadPool& pool);
+			~BlockingRegion();
+
+		private:
+			BlockingRegion(const BlockingRegion&) = delete;
+			BlockingRegion& operator=(const BlockingRegion&) = delete;
+
+			ThreadPool& pool;
+		};
+
 		explicit ThreadPool(const int num_of_threads = ThreadPool::GetNumberOfHardwareThreads());
+		explicit ThreadPool(const Config& config);
 		~ThreadPool();
 
+		enum class ShutdownMode
+		{
+			Drain,  // Run every queued task before stopping the workers; tasks running on the pool can still submit follow-up work until it is idle
+			Discard  // Drop queued tasks (their futures throw std::future_error with broken_promise) and only wait for the running ones
+		};
+
+		/**
+		 * @brief Stop accepting tasks from other threads and join the workers. Calling it again has no effect; the destructor calls Shutdown(ShutdownMode::Drain).
+		 * Must not be called from a task running on this pool.
+		 */
+		void Shutdown(const ShutdownMode mode = ShutdownMode::Drain);
+
+		/**
+		 * @brief Block until every task submitted so far has finished or was dropped. Must not be called from a task running on this pool.
+		 */
+		void WaitIdle();
+
+		/**
+		 * @brief Get the CPUs this process is allowed to run on.
+		 */
+		static std::vector<int> GetAvailableCpus();
 
+		/**
+		 * @brief Split the available CPUs into 'num_of_groups' disjoint groups of neighbouring cores, so that several pools can be created
+		 * without evicting each other's caches (e.g. one for robot-status processing and one for bulk I/O).
+		 * Throws std::invalid_argument if there are fewer available CPUs than groups.
+		 */
+		static std::vector<std::vector<int>> GetDisjointCpuGroups(const int num_of_groups);
+
+		/**
+		 * @brief Get a snapshot of the pool telemetry. Counters are read without stopping the workers, so the snapshot is only approximately consistent.
+		 */
+		PoolStats Stats() const;
+
+		/**
+		 * @brief Start a background thread that passes Stats() to 'callback' every 'period', e.g. to log PoolStats::ToString() with the application's logger.
+		 * Calling it again replaces the previous dump.
+		 */
+		void StartStatsDump(const std::chrono::milliseconds period, std::function<void(const PoolStats&)> callback);
+		void StopStatsDump();
+
+
+		/**
+		 * @brief Submit a task. Throws std::runtime_error if the pool was shut down, unless it is called from a task running on the pool during a drain.
+		 */
 		template<typename FunctionType, typename... ArgumentType>
 		inline std::future<std::result_of_t<FunctionType(ArgumentType...)>> Enqueue(FunctionType&& function, ArgumentType&&... arguments)
+		{
+			return EnqueueTask(nullptr, std::forward<FunctionType>(function), std::forward<ArgumentType>(arguments)...);
+		}
+
+		/**
+		 * @brief Submit a task that is dropped instead of run if 'token' is cancelled before a worker picks it up.
+		 * The future of a dropped task throws std::future_error with broken_promise. Throws std::runtime_error if the pool was shut down.
+		 */
+		template<typename FunctionType, typename... ArgumentType>
+		inline std::future<std::result_of_t<FunctionType(ArgumentType...)>> EnqueueCancellable(const CancellationToken& token, FunctionType&& function, ArgumentType&&... arguments)
+		{
+			return EnqueueTask(token.is_cancelled, std::forward<FunctionType>(function), std::forward<ArgumentType>(arguments)...);
+		}
+
+
+	private:
+		struct Task
+		{
+			std::function<void()> function;
+			std::chrono::steady_clock::time_point enqueue_time;
+
+			// Null for tasks that cannot be cancelled
+			std::shared_ptr<std::atomic<bool>> is_cancelled;
+		};
+
+		/**
+		 * @brief Telemetry counters of one worker. Every worker writes only its own counters, so they are padded to a cache line
+		 * to avoid false sharing, and updated with plain relaxed stores instead of atomic read-modify-write operations.
+		 */
+		struct alignas(64) WorkerCounters
+		{
+			std::chrono::steady_clock::time_point start_time;
+			std::atomic<uint64_t> tasks_executed{ 0 };
+			std::atomic<uint64_t> busy_ns{ 0 };
+			std::array<std::atomic<uint64_t>, THREAD_POOL_HISTOGRAM_BUCKETS> queue_wait_histogram{};
+			std::array<std::atomic<uint64_t>, THREAD_POOL_HISTOGRAM_BUCKETS> run_time_histogram{};
+		};
+
+		struct Worker
+		{
+			std::thread thread;
+			WorkerCounters counters;
+
+			// Set by a retiring worker right before its thread function returns, so that it can be joined
+			std::atomic<bool> has_exited{ false };
+
+			// Futex word the new thread waits on until SpawnWorker() has pinned and named it, see WORKER_STARTING
+			std::atomic<uint32_t> start_state{ 0 };
+		};
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool(ThreadPool&&) = delete;
+
+		ThreadPool& operator=(const ThreadPool&) = delete;
+		ThreadPool& operator=(ThreadPool&&) = delete;
+
+		template<typename FunctionType, typename... ArgumentType>
+		inline std::future<std::result_of_t<FunctionType(ArgumentType...)>> EnqueueTask(std::shared_ptr<std::atomic<bool>> is_cancelled, FunctionType&& function, ArgumentType&&... arguments)
 		{
 			typedef std::result_of_t<FunctionType(ArgumentType...)> ResultType;
 
@@ -29,35 +255,111 @@ namespace rtkcommunication
 
 			std::future<ResultType> result = task->get_future();
 
-			{
-				std::unique_lock<std::mutex> lock(queue_mutex);
-				tasks_queue.emplace([task]() { (*task)(); });
-			}
-
-			cond_variable.notify_one();
+			Push({ [task]() { (*task)(); }, std::chrono::steady_clock::now(), std::move(is_cancelled) });
 
 			return result;
 		}
 
+		void Push(Task&& task);
 
-	private:
-		ThreadPool(const ThreadPool&) = delete;
-		ThreadPool(ThreadPool&&) = delete;
+		/**
+		 * @brief Account for a task that finished or was dropped, and wake WaitIdle() callers if it was the last one.
+		 */
+		void FinishTask();
 
-		ThreadPool& operator=(const ThreadPool&) = delete;
-		ThreadPool& operator=(ThreadPool&&) = delete;
+		void Start(const Config& config);
+		void StopWorkers();
+
+		/**
+		 * @brief Start one worker, pinned and named according to the config. Must be called with 'workers_mutex' locked.
+		 * The thread runs no task before it is pinned. Throws std::system_error if the thread cannot be created or pinned, in which case it is joined again.
+		 */
+		void SpawnWorker();
+
+		/**
+		 * @brief Spawn one worker if the pool is below 'max_workers' and not stopping. Failures are ignored, the pool keeps running with the workers it has.
+		 * Called only by the supervisor, which also reaps retired workers here.
+		 */
+		void TrySpawnWorker();
+
+		/**
+		 * @brief Ask the supervisor for one more worker. Cheap enough for workers and blocking regions, which must not spawn or join threads themselves.
+		 */
+		void RequestWorker();
+
+		/**
+		 * @brief Join retired workers and fold their counters into 'retired_counters'. Must be called with 'workers_mutex' locked.
+		 */
+		void ReapRetiredWorkers();
+
+		/**
+		 * @brief Elastic pools only: spawn a worker when one is requested or the queue is stalled (e.g. all workers blocked) and reap retired workers.
+		 */
+		void SupervisorFunction();
 
-		void WorkerFunction();
+		void WorkerFunction(Worker& worker);
+
+		bool TryDequeue(Task& task);
+
+		/**
+		 * @brief Idle strategy of a worker that found the queue empty: spin for a short bounded time and, if no task shows up, park on a futex.
+		 * Returns false if the worker should retire, because it was idle for 'idle_timeout' and the pool is above 'min_workers'.
+		 */
+		bool WaitForTask();
+
+		/**
+		 * @brief Wake one parked worker, but only if no worker is already spinning - a spinning worker will pick up the task on its own.
+		 */
+		void WakeWorker();
 
 		static int GetNumberOfHardwareThreads();
 
 
-		std::vector<std::thread> workers_vec;
-		bool should_stop;
+		Config pool_config;
+
+		mutable std::mutex workers_mutex;
+		std::vector<std::unique_ptr<Worker>> workers_vec;
+		WorkerCounters retired_counters;
+		int spawned_workers;
+		std::atomic<int> live_workers;
+		std::atomic<int> blocked_workers;
+		std::atomic<bool> should_stop;
+
+		std::mutex shutdown_mutex;
+
+		std::thread supervisor_thread;
+		std::mutex supervisor_mutex;
+		std::condition_variable supervisor_cond_variable;
+		std::atomic<bool> is_worker_requested;
+
+		MpmcQueue<Task> tasks_queue;
+
+		// Only used while 'tasks_queue' is full
+		std::mutex overflow_mutex;
+		std::deque<Task> overflow_queue;
+		std::atomic<size_t> overflow_size;
+
+		std::atomic<size_t> queue_high_water_mark;
+		std::atomic<bool> is_accepting;
+
+		// Set while Shutdown(ShutdownMode::Drain) waits for the queue, workers of this pool may still submit
+		std::atomic<bool> is_draining;
+
+		// Tasks queued or running; WaitIdle() waits for it to drop to zero
+		std::atomic<size_t> unfinished_tasks;
+		std::mutex idle_mutex;
+		std::condition_variable idle_cond_variable;
 
-		std::mutex queue_mutex;
-		std::condition_variable cond_variable;
+		// Incremented before a task is pushed and decremented after it is popped, so it never underflows
+		std::atomic<size_t> pending_tasks;
+		std::atomic<uint64_t> dequeued_tasks;
+		std::atomic<int> searching_workers;
+		std::atomic<int> sleeping_workers;
+		std::atomic<uint32_t> wake_epoch;
 
-		std::queue<std::function<void()>> tasks_queue;
+		std::thread stats_dump_thread;
+		std::mutex stats_dump_mutex;
+		std::condition_variable stats_dump_cond_variable;
+		bool should_stop_stats_dump;
 	};
 }
\ No newline at end of file
@@ -0,0 +1,568 @@
+/**
+ * Benchmark of rtkcommunication::ThreadPool compared against std::async and plain std::thread at 1..N threads.
+ *
+ * Workloads:
+ *  - empty_tasks:      throughput of submitting and running empty tasks
+ *  - fork_join:        latency of forking one task per thread and joining them all
+ *  - recursive_fanout: fib-style recursion where every task spawns two children until a cutoff
+ *  - producer_heavy:   one producer per thread submitting empty tasks concurrently
+ *  - mixed_blocking:   half of the tasks sleep (I/O-like), half of them burn CPU
+ *
+ * Every implementation runs the same tasks at the same granularity: std::async and std::thread start one thread per task.
+ * Because of that they get fewer tasks where the pool runs millions of them, and those workloads report rates rather than totals.
+ *
+ * Usage: ThreadPoolBenchmark [--max-threads=N] [--format=csv|json] [--scale=F]
+ * Results are written to stdout, one row per (workload, implementation, threads, metric).
+ */
+
+#include "rtkcommunication/Common/ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace rtkcommunication;
+
+
+namespace
+{
+	typedef std::chrono::steady_clock Clock;
+
+	struct Result
+	{
+		std::string workload;
+		std::string implementation;
+		int threads;
+		std::string metric;
+		double value;
+		std::string unit;
+	};
+
+
+	double SecondsSince(const Clock::time_point start)
+	{
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+
+	double Percentile(std::vector<double> samples, const double percentile)
+	{
+		if (samples.empty() == true)
+			return 0;
+
+		std::sort(samples.begin(), samples.end());
+		size_t index = (size_t)(percentile / 100.0 * (double)(samples.size() - 1));
+
+		return samples[index];
+	}
+
+
+	void BurnCpu(const std::chrono::microseconds duration)
+	{
+		Clock::time_point end = Clock::now() + duration;
+		while (Clock::now() < end)
+		{
+		}
+	}
+
+
+	ThreadPool::Config MakeConfig(const int threads)
+	{
+		ThreadPool::Config config;
+		config.num_of_workers = threads;
+		config.name = "bench";
+
+		return config;
+	}
+
+
+	// std::async and std::thread start a thread per task, so they get a smaller batch of the same tasks
+	size_t GetNumberOfThreadPerTaskTasks(const size_t num_of_tasks)
+	{
+		return std::max<size_t>(num_of_tasks / 100, 1);
+	}
+
+
+	///////////////////////////////////////////////////////////////////////// empty_tasks
+
+	void EmptyTasks(const int threads, const size_t num_of_tasks, std::vector<Result>& results)
+	{
+		{
+			ThreadPool pool(MakeConfig(threads));
+
+			Clock::time_point start = Clock::now();
+			for (size_t i = 0; i < num_of_tasks; i++)
+				pool.Enqueue([]() {});
+			pool.WaitIdle();
+
+			results.push_back({ "empty_tasks", "thread_pool", threads, "throughput", num_of_tasks / SecondsSince(start), "tasks/s" });
+		}
+
+		size_t num_of_thread_tasks = GetNumberOfThreadPerTaskTasks(num_of_tasks);
+
+		{
+			std::vector<std::future<void>> futures;
+			futures.reserve(threads);
+
+			Clock::time_point start = Clock::now();
+			for (size_t i = 0; i < num_of_thread_tasks; i += threads)
+			{
+				futures.clear();
+				for (int t = 0; t < threads; t++)
+					futures.push_back(std::async(std::launch::async, []() {}));
+				for (std::future<void>& future : futures)
+					future.get();
+			}
+
+			results.push_back({ "empty_tasks", "std_async", threads, "throughput", num_of_thread_tasks / SecondsSince(start), "tasks/s" });
+		}
+
+		{
+			std::vector<std::thread> workers;
+			workers.reserve(threads);
+
+			Clock::time_point start = Clock::now();
+			for (size_t i = 0; i < num_of_thread_tasks; i += threads)
+			{
+				workers.clear();
+				for (int t = 0; t < threads; t++)
+					workers.emplace_back([]() {});
+				for (std::thread& worker : workers)
+					worker.join();
+			}
+
+			results.push_back({ "empty_tasks", "std_thread", threads, "throughput", num_of_thread_tasks / SecondsSince(start), "tasks/s" });
+		}
+	}
+
+
+	///////////////////////////////////////////////////////////////////////// fork_join
+
+	void AddLatencyResults(const std::string& implementation, const int threads, const std::vector<double>& samples, std::vector<Result>& results)
+	{
+		results.push_back({ "fork_join", implementation, threads, "latency_p50", Percentile(samples, 50), "us" });
+		results.push_back({ "fork_join", implementation, threads, "latency_p99", Percentile(samples, 99), "us" });
+	}
+
+
+	void ForkJoin(const int threads, const size_t num_of_rounds, std::vector<Result>& results)
+	{
+		std::vector<double> samples;
+		samples.reserve(num_of_rounds);
+
+		{
+			ThreadPool pool(MakeConfig(threads));
+			std::vector<std::future<void>> futures;
+
+			for (size_t round = 0; round < num_of_rounds; round++)
+			{
+				Clock::time_point start = Clock::now();
+
+				futures.clear();
+				for (int t = 0; t < threads; t++)
+					futures.push_back(pool.Enqueue([]() {}));
+				for (std::future<void>& future : futures)
+					future.get();
+
+				samples.push_back(SecondsSince(start) * 1e6);
+			}
+
+			AddLatencyResults("thread_pool", threads, samples, results);
+		}
+
+		samples.clear();
+
+		{
+			std::vector<std::future<void>> futures;
+
+			for (size_t round = 0; round < num_of_rounds; round++)
+			{
+				Clock::time_point start = Clock::now();
+
+				futures.clear();
+				for (int t = 0; t < threads; t++)
+					futures.push_back(std::async(std::launch::async, []() {}));
+				for (std::future<void>& future : futures)
+					future.get();
+
+				samples.push_back(SecondsSince(start) * 1e6);
+			}
+
+			AddLatencyResults("std_async", threads, samples, results);
+		}
+
+		samples.clear();
+
+		{
+			std::vector<std::thread> workers;
+
+			for (size_t round = 0; round < num_of_rounds; round++)
+			{
+				Clock::time_point start = Clock::now();
+
+				workers.clear();
+				for (int t = 0; t < threads; t++)
+					workers.emplace_back([]() {});
+				for (std::thread& worker : workers)
+					worker.join();
+
+				samples.push_back(SecondsSince(start) * 1e6);
+			}
+
+			AddLatencyResults("std_thread", threads, samples, results);
+		}
+	}
+
+
+	///////////////////////////////////////////////////////////////////////// recursive_fanout
+
+	int Fib(const int n)
+	{
+		return n < 2 ? n : Fib(n - 1) + Fib(n - 2);
+	}
+
+
+	// Tasks never block on their children (that would deadlock a fixed pool), leaves add their result to 'sum' instead
+	void FibTask(ThreadPool& pool, const int n, const int cutoff, std::atomic<long>& sum)
+	{
+		if (n <= cutoff)
+		{
+			sum += Fib(n);
+			return;
+		}
+
+		pool.Enqueue(FibTask, std::ref(pool), n - 1, cutoff, std::ref(sum));
+		pool.Enqueue(FibTask, std::ref(pool), n - 2, cutoff, std::ref(sum));
+	}
+
+
+	long FibAsync(const int n, const int cutoff)
+	{
+		if (n <= cutoff)
+			return Fib(n);
+
+		std::future<long> left = std::async(std::launch::async, FibAsync, n - 1, cutoff);
+		long right = FibAsync(n - 2, cutoff);
+
+		return left.get() + right;
+	}
+
+
+	long FibThread(const int n, const int cutoff)
+	{
+		if (n <= cutoff)
+			return Fib(n);
+
+		long left = 0;
+		std::thread thread([&left, n, cutoff]() { left = FibThread(n - 1, cutoff); });
+		long right = FibThread(n - 2, cutoff);
+		thread.join();
+
+		return left + right;
+	}
+
+
+	void RecursiveFanout(const int threads, const int n, std::vector<Result>& results)
+	{
+		// Every implementation splits the same tree down to the same cutoff: 376 inner nodes, each of them a task or a thread,
+		// and leaves of Fib(n - 12) or Fib(n - 13). A lower cutoff would make std::async and std::thread start thousands of threads at once
+		const int cutoff = n - 12;
+
+		{
+			ThreadPool pool(MakeConfig(threads));
+			std::atomic<long> sum(0);
+
+			Clock::time_point start = Clock::now();
+			pool.Enqueue(FibTask, std::ref(pool), n, cutoff, std::ref(sum));
+			pool.WaitIdle();
+
+			results.push_back({ "recursive_fanout", "thread_pool", threads, "time", SecondsSince(start) * 1e3, "ms" });
+		}
+
+		{
+			Clock::time_point start = Clock::now();
+			FibAsync(n, cutoff);
+
+			results.push_back({ "recursive_fanout", "std_async", threads, "time", SecondsSince(start) * 1e3, "ms" });
+		}
+
+		{
+			Clock::time_point start = Clock::now();
+			FibThread(n, cutoff);
+
+			results.push_back({ "recursive_fanout", "std_thread", threads, "time", SecondsSince(start) * 1e3, "ms" });
+		}
+	}
+
+
+	///////////////////////////////////////////////////////////////////////// producer_heavy
+
+	// 'submit' is called 'tasks_per_producer' times by each of 'threads' producers, 'wait' after all of them finished
+	template<typename SubmitType, typename WaitType>
+	void RunProducers(const std::string& implementation, const int threads, const size_t tasks_per_producer, SubmitType submit, WaitType wait,
+		std::vector<Result>& results)
+	{
+		std::vector<std::thread> producers;
+		std::vector<double> enqueue_ns(threads);
+
+		Clock::time_point start = Clock::now();
+		for (int t = 0; t < threads; t++)
+		{
+			producers.emplace_back([&submit, &enqueue_ns, t, tasks_per_producer]()
+			{
+				Clock::time_point producer_start = Clock::now();
+				for (size_t i = 0; i < tasks_per_producer; i++)
+					submit(t);
+				enqueue_ns[t] = SecondsSince(producer_start) * 1e9 / tasks_per_producer;
+			});
+		}
+		for (std::thread& producer : producers)
+			producer.join();
+		wait();
+
+		double total_time = SecondsSince(start);
+		double mean_enqueue_ns = 0;
+		for (double ns : enqueue_ns)
+			mean_enqueue_ns += ns / threads;
+
+		results.push_back({ "producer_heavy", implementation, threads, "throughput", tasks_per_producer * threads / total_time, "tasks/s" });
+		results.push_back({ "producer_heavy", implementation, threads, "enqueue_cost", mean_enqueue_ns, "ns" });
+	}
+
+
+	void ProducerHeavy(const int threads, const size_t tasks_per_producer, std::vector<Result>& results)
+	{
+		{
+			ThreadPool pool(MakeConfig(threads));
+
+			RunProducers("thread_pool", threads, tasks_per_producer, [&pool](const int) { pool.Enqueue([]() {}); }, [&pool]() { pool.WaitIdle(); }, results);
+		}
+
+		size_t thread_tasks_per_producer = GetNumberOfThreadPerTaskTasks(tasks_per_producer);
+
+		{
+			// Every producer keeps its own futures, so submitting does not wait for the task. A future of std::async holds its
+			// thread until get(), so they are collected every MAX_ASYNC_IN_FLIGHT tasks to keep the number of unjoined threads bounded
+			const size_t MAX_ASYNC_IN_FLIGHT = 64;
+			std::vector<std::vector<std::future<void>>> futures(threads);
+
+			auto get_futures = [](std::vector<std::future<void>>& producer_futures)
+			{
+				for (std::future<void>& future : producer_futures)
+					future.get();
+				producer_futures.clear();
+			};
+
+			RunProducers("std_async", threads, thread_tasks_per_producer,
+				[&futures, &get_futures, MAX_ASYNC_IN_FLIGHT](const int t)
+				{
+					if (futures[t].size() == MAX_ASYNC_IN_FLIGHT)
+						get_futures(futures[t]);
+					futures[t].push_back(std::async(std::launch::async, []() {}));
+				},
+				[&futures, &get_futures]()
+				{
+					for (std::vector<std::future<void>>& producer_futures : futures)
+						get_futures(producer_futures);
+				},
+				results);
+		}
+
+		{
+			// Detached, so that finished threads release their stacks right away
+			std::atomic<size_t> finished_tasks(0);
+
+			RunProducers("std_thread", threads, thread_tasks_per_producer,
+				[&finished_tasks](const int) { std::thread([&finished_tasks]() { finished_tasks++; }).detach(); },
+				[&finished_tasks, threads, thread_tasks_per_producer]()
+				{
+					while (finished_tasks < threads * thread_tasks_per_producer)
+						std::this_thread::yield();
+				},
+				results);
+		}
+	}
+
+
+	///////////////////////////////////////////////////////////////////////// mixed_blocking
+
+	void MixedBlocking(const int threads, const size_t num_of_tasks, std::vector<Result>& results)
+	{
+		const std::chrono::microseconds block_time(1000);
+		const std::chrono::microseconds cpu_time(50);
+
+		{
+			ThreadPool pool(MakeConfig(threads));
+
+			Clock::time_point start = Clock::now();
+			for (size_t i = 0; i < num_of_tasks; i++)
+			{
+				if (i % 2 == 0)
+					pool.Enqueue([block_time]() { std::this_thread::sleep_for(block_time); });
+				else
+					pool.Enqueue([cpu_time]() { BurnCpu(cpu_time); });
+			}
+			pool.WaitIdle();
+
+			results.push_back({ "mixed_blocking", "thread_pool", threads, "time", SecondsSince(start) * 1e3, "ms" });
+		}
+
+		{
+			// Same pool, but blocking tasks announce themselves and the pool may grow to compensate
+			ThreadPool::Config config = MakeConfig(threads);
+			config.max_workers = threads * 4;
+
+			ThreadPool pool(config);
+
+			Clock::time_point start = Clock::now();
+			for (size_t i = 0; i < num_of_tasks; i++)
+			{
+				if (i % 2 == 0)
+				{
+					pool.Enqueue([&pool, block_time]()
+					{
+						ThreadPool::BlockingRegion region(pool);
+						std::this_thread::sleep_for(block_time);
+					});
+				}
+				else
+				{
+					pool.Enqueue([cpu_time]() { BurnCpu(cpu_time); });
+				}
+			}
+			pool.WaitIdle();
+
+			results.push_back({ "mixed_blocking", "thread_pool_elastic", threads, "time", SecondsSince(start) * 1e3, "ms" });
+		}
+
+		{
+			std::vector<std::future<void>> futures;
+			futures.reserve(num_of_tasks);
+
+			Clock::time_point start = Clock::now();
+			for (size_t i = 0; i < num_of_tasks; i += threads)
+			{
+				futures.clear();
+				for (size_t j = i; j < std::min(num_of_tasks, i + threads); j++)
+				{
+					if (j % 2 == 0)
+						futures.push_back(std::async(std::launch::async, [block_time]() { std::this_thread::sleep_for(block_time); }));
+					else
+						futures.push_back(std::async(std::launch::async, [cpu_time]() { BurnCpu(cpu_time); }));
+				}
+				for (std::future<void>& future : futures)
+					future.get();
+			}
+
+			results.push_back({ "mixed_blocking", "std_async", threads, "time", SecondsSince(start) * 1e3, "ms" });
+		}
+
+		{
+			std::vector<std::thread> workers;
+
+			Clock::time_point start = Clock::now();
+			for (int t = 0; t < threads; t++)
+			{
+				workers.emplace_back([t, threads, num_of_tasks, block_time, cpu_time]()
+				{
+					for (size_t i = t; i < num_of_tasks; i += threads)
+					{
+						if (i % 2 == 0)
+							std::this_thread::sleep_for(block_time);
+						else
+							BurnCpu(cpu_time);
+					}
+				});
+			}
+			for (std::thread& worker : workers)
+				worker.join();
+
+			results.push_back({ "mixed_blocking", "std_thread", threads, "time", SecondsSince(start) * 1e3, "ms" });
+		}
+	}
+
+
+	///////////////////////////////////////////////////////////////////////// output
+
+	void PrintCsv(const std::vector<Result>& results)
+	{
+		std::cout << "workload,implementation,threads,metric,value,unit\n";
+
+		for (const Result& result : results)
+		{
+			std::cout << result.workload << "," << result.implementation << "," << result.threads << ","
+				<< result.metric << "," << result.value << "," << result.unit << "\n";
+		}
+	}
+
+
+	void PrintJson(const std::vector<Result>& results)
+	{
+		std::cout << "[\n";
+
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			const Result& result = results[i];
+
+			std::cout << "  {\"workload\": \"" << result.workload << "\", \"implementation\": \"" << result.implementation
+				<< "\", \"threads\": " << result.threads << ", \"metric\": \"" << result.metric
+				<< "\", \"value\": " << result.value << ", \"unit\": \"" << result.unit << "\"}"
+				<< (i + 1 < results.size() ? "," : "") << "\n";
+		}
+
+		std::cout << "]\n";
+	}
+}
+
+
+int main(int argc, char* argv[])
+{
+	int max_threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+	std::string format = "csv";
+	double scale = 1.0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::strncmp(argv[i], "--max-threads=", 14) == 0)
+			max_threads = std::max(std::stoi(argv[i] + 14), 1);
+		else if (std::strncmp(argv[i], "--format=", 9) == 0)
+			format = argv[i] + 9;
+		else if (std::strncmp(argv[i], "--scale=", 8) == 0)
+			scale = std::stod(argv[i] + 8);
+		else
+		{
+			std::cerr << "Usage: " << argv[0] << " [--max-threads=N] [--format=csv|json] [--scale=F]" << std::endl;
+			return 1;
+		}
+	}
+
+	// Powers of two, plus 'max_threads' itself when it is not one
+	std::vector<int> thread_counts;
+	for (int threads = 1; threads < max_threads; threads *= 2)
+		thread_counts.push_back(threads);
+	thread_counts.push_back(max_threads);
+
+	std::vector<Result> results;
+
+	for (int threads : thread_counts)
+	{
+		EmptyTasks(threads, (size_t)(1000000 * scale), results);
+		ForkJoin(threads, (size_t)(2000 * scale), results);
+		RecursiveFanout(threads, 30, results);
+		ProducerHeavy(threads, (size_t)(200000 * scale), results);
+		MixedBlocking(threads, (size_t)(400 * scale), results);
+	}
+
+	if (format == "json")
+		PrintJson(results);
+	else
+		PrintCsv(results);
+
+	return 0;
+}
\ No newline at end of file
@@ -1,5 +1,27 @@
 #include "rtkcommunication/Common/Session.h"
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <random>
+#include <set>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/sinks/rotating_file_sink.h>
@@ -7,449 +29,3145 @@
 using namespace rtkcommunication;
 
 
+namespace
+{
+	// Reflected CRC32C (Castagnoli) polynomial
+	const uint32_t CRC32C_POLYNOMIAL = 0x82F63B78;
+
+	struct Crc32cTable
+	{
+		uint32_t entries[256];
+
+		Crc32cTable()
+		{
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t crc = i;
+				for (int bit = 0; bit < 8; bit++)
+					crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLYNOMIAL : 0);
+
+				entries[i] = crc;
+			}
+		}
+	};
+
+	uint32_t Crc32cSoftware(uint32_t crc, const char* data, size_t size)
+	{
+		static const Crc32cTable table;
+
+		for (size_t i = 0; i < size; i++)
+			crc = table.entries[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+
+		return crc;
+	}
+
+#if defined(__x86_64__)
+	__attribute__((target("sse4.2"))) uint32_t Crc32cHardware(uint32_t crc, const char* data, size_t size)
+	{
+		uint64_t crc64 = crc;
+
+		for (; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t))
+		{
+			uint64_t word;
+			memcpy(&word, data, sizeof(uint64_t));
+			crc64 = _mm_crc32_u64(crc64, word);
+		}
+
+		crc = (uint32_t)crc64;
+		for (; size > 0; data++, size--)
+			crc = _mm_crc32_u8(crc, (uint8_t)*data);
+
+		return crc;
+	}
+#endif
+
+	// Deflate context of one sending thread, reset for every frame
+	struct DeflateContext
+	{
+		z_stream stream;
+		bool is_valid;
+
+		DeflateContext()
+			: stream()
+		{
+			// Raw deflate, the frame header already carries everything a zlib header would
+			is_valid = deflateInit2(&stream, SESSION_COMPRESSION_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+		}
+
+		~DeflateContext()
+		{
+			if (is_valid == true)
+				deflateEnd(&stream);
+		}
+	};
+
+	// Adapts a callback that only takes the message of a connection error
+	std::function<void(const boost::system::error_code&, std::string)> WithErrorCode(std::function<void(std::string)> OnConnectionError)
+	{
+		if (OnConnectionError == nullptr)
+			return nullptr;
+
+		return [OnConnectionError](const boost::system::error_code&, std::string message) { OnConnectionError(message); };
+	}
+
+	// sendfile() has no MSG_NOSIGNAL, so SIGPIPE of a closed peer is blocked for the call and taken back off the thread,
+	// otherwise it would kill the process
+	ssize_t SendFileNoSignal(int out_fd, int in_fd, off_t* offset, size_t count)
+	{
+		sigset_t sigpipe;
+		sigemptyset(&sigpipe);
+		sigaddset(&sigpipe, SIGPIPE);
+
+		// A SIGPIPE already pending was raised by someone else and is left alone
+		sigset_t pending;
+		sigpending(&pending);
+		bool is_pending = sigismember(&pending, SIGPIPE) == 1;
+
+		sigset_t old_mask;
+		pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+
+		ssize_t result = sendfile(out_fd, in_fd, offset, count);
+		int send_errno = errno;
+
+		// Checked whatever the result, a write cut short by the peer closing returns the bytes sent but raises SIGPIPE too
+		sigpending(&pending);
+		if (!is_pending && sigismember(&pending, SIGPIPE) == 1)
+		{
+			struct timespec no_wait = { 0, 0 };
+			while (sigtimedwait(&sigpipe, nullptr, &no_wait) < 0 && errno == EINTR)
+				;
+		}
+
+		pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+		errno = send_errno;
+
+		return result;
+	}
+}
+
+namespace
+{
+	inline uint64_t RotateLeft(uint64_t x, int r)
+	{
+		return (x << r) | (x >> (64 - r));
+	}
+
+	inline uint64_t Murmur3Mix(uint64_t k)
+	{
+		k ^= k >> 33;
+		k *= 0xff51afd7ed558ccdULL;
+		k ^= k >> 33;
+		k *= 0xc4ceb9fe1a85ec53ULL;
+		k ^= k >> 33;
+
+		return k;
+	}
+
+	/**
+	 * @brief MurmurHash3 x64 128-bit (seed 0) of a file, read in FILE_HASH_BLOCK_SIZE blocks. Returns false if the file cannot be read.
+	 */
+	bool Murmur3File(const std::string& file_path, uint64_t hash[2], uint64_t& size, int64_t& mtime)
+	{
+		const uint64_t c1 = 0x87c37b91114253d5ULL;
+		const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+		int fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+
+		struct stat file_stat;
+		fstat(fd, &file_stat);
+		size = file_stat.st_size;
+		mtime = (int64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
+
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		uint64_t h1 = 0;
+		uint64_t h2 = 0;
+		uint64_t length = 0;
+
+		// A multiple of 16, so only the last block has a tail
+		std::unique_ptr<char[]> block(new char[FILE_HASH_BLOCK_SIZE]);
+
+		while (true)
+		{
+			size_t block_size = 0;
+			while (block_size < FILE_HASH_BLOCK_SIZE)
+			{
+				ssize_t result = read(fd, block.get() + block_size, FILE_HASH_BLOCK_SIZE - block_size);
+
+				if (result < 0 && errno == EINTR)
+					continue;
+
+				if (result < 0)
+				{
+					close(fd);
+					return false;
+				}
+
+				if (result == 0)
+					break;
+
+				block_size += result;
+			}
+
+			length += block_size;
+
+			const char* data = block.get();
+			size_t num_of_words = block_size / 16;
+
+			for (size_t i = 0; i < num_of_words; i++)
+			{
+				uint64_t k1;
+				uint64_t k2;
+				memcpy(&k1, data + i * 16, sizeof(uint64_t));
+				memcpy(&k2, data + i * 16 + 8, sizeof(uint64_t));
+
+				k1 *= c1; k1 = RotateLeft(k1, 31); k1 *= c2; h1 ^= k1;
+				h1 = RotateLeft(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+				k2 *= c2; k2 = RotateLeft(k2, 33); k2 *= c1; h2 ^= k2;
+				h2 = RotateLeft(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+			}
+
+			if (block_size < FILE_HASH_BLOCK_SIZE)
+			{
+				const uint8_t* tail = (const uint8_t*)data + num_of_words * 16;
+				size_t tail_size = block_size % 16;
+
+				uint64_t k1 = 0;
+				uint64_t k2 = 0;
+
+				for (size_t i = tail_size; i > 8; i--)
+					k2 = (k2 << 8) | tail[i - 1];
+
+				for (size_t i = std::min(tail_size, (size_t)8); i > 0; i--)
+					k1 = (k1 << 8) | tail[i - 1];
+
+				if (tail_size > 8)
+				{
+					k2 *= c2; k2 = RotateLeft(k2, 33); k2 *= c1; h2 ^= k2;
+				}
+
+				if (tail_size > 0)
+				{
+					k1 *= c1; k1 = RotateLeft(k1, 31); k1 *= c2; h1 ^= k1;
+				}
+
+				break;
+			}
+		}
+
+		close(fd);
+
+		h1 ^= length;
+		h2 ^= length;
+		h1 += h2;
+		h2 += h1;
+		h1 = Murmur3Mix(h1);
+		h2 = Murmur3Mix(h2);
+		h1 += h2;
+		h2 += h1;
+
+		hash[0] = h1;
+		hash[1] = h2;
+
+		return true;
+	}
+
+	/**
+	 * @brief Digests of files hashed before, keyed by path. An entry is reused while the file keeps its size and modification time,
+	 * so a repeated sync of an unchanged folder does not read it again.
+	 */
+	class FileDigestCache
+	{
+
+	public:
+		bool Find(const std::string& file_path, FileDigest& digest)
+		{
+			struct stat file_stat;
+			if (stat(file_path.c_str(), &file_stat) != 0)
+				return false;
+
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			auto it = _digests.find(file_path);
+			if (it == _digests.end() || it->second.size != (uint64_t)file_stat.st_size ||
+				it->second.mtime != (int64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec)
+				return false;
+
+			digest = it->second;
+			return true;
+		}
+
+		void Insert(const std::string& file_path, const FileDigest& digest)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			_digests[file_path] = digest;
+		}
+
+	private:
+		std::mutex _mutex;
+		std::unordered_map<std::string, FileDigest> _digests;
+	};
+
+	FileDigestCache file_digest_cache;
+}
+
+void Session::ComputeFileDigests(const std::vector<std::string>& file_paths, ThreadPool& pool, std::function<void(std::vector<FileDigest>)> callback,
+	const std::vector<bool>& skip_hash)
+{
+	struct DigestJob
+	{
+		std::vector<FileDigest> digests;
+		std::atomic<size_t> remaining;
+		std::function<void(std::vector<FileDigest>)> callback;
+	};
+
+	std::shared_ptr<DigestJob> job = std::make_shared<DigestJob>();
+	job->digests.resize(file_paths.size(), FileDigest{ 0, 0, { 0, 0 } });
+	job->remaining = file_paths.size();
+	job->callback = callback;
+
+	if (file_paths.empty())
+	{
+		callback({});
+		return;
+	}
+
+	// One task per file; the task finishing last hands the digests over, so no thread blocks waiting for the others
+	for (size_t i = 0; i < file_paths.size(); i++)
+	{
+		bool is_hash_skipped = i < skip_hash.size() && skip_hash[i];
+
+		pool.Enqueue([job, i, file_path = file_paths[i], is_hash_skipped]()
+		{
+			FileDigest& digest = job->digests[i];
+
+			if (is_hash_skipped)
+			{
+				struct stat file_stat;
+				if (stat(file_path.c_str(), &file_stat) == 0)
+				{
+					digest.size = file_stat.st_size;
+					digest.mtime = (int64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
+				}
+				else
+				{
+					digest.size = UINT64_MAX;
+				}
+			}
+			else if (file_digest_cache.Find(file_path, digest) == false)
+			{
+				if (Murmur3File(file_path, digest.hash, digest.size, digest.mtime) == true)
+					file_digest_cache.Insert(file_path, digest);
+				else
+					digest = FileDigest{ UINT64_MAX, 0, { 0, 0 } };
+			}
+
+			if (job->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				job->callback(std::move(job->digests));
+		});
+	}
+}
+
+uint32_t rtkcommunication::Crc32c(const char* data, size_t size, uint32_t crc)
+{
+	crc = ~crc;
+
+#if defined(__x86_64__)
+	static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+
+	if (has_sse42)
+		return ~Crc32cHardware(crc, data, size);
+#endif
+
+	return ~Crc32cSoftware(crc, data, size);
+}
+
+
 Session::Session() 
 	: _io_service(new boost::asio::io_service()),
-	_socket(new boost::asio::ip::tcp::socket(*_io_service)),
 	_strand(new boost::asio::io_service::strand(*_io_service)),
-	OnReceiveUpdate(nullptr), 
-	OnSendUpdate(nullptr), 
-	OnSendComplete(nullptr),
-	_write_msgs_size(0),
-	_total_write_size(0),
+	_socket(new boost::asio::ip::tcp::socket(*_io_service)),
+	_outbound_in_flight(0),
+	_is_writing(false),
+	_connection_id(0),
+	_read_handler_memory(std::make_shared<HandlerMemory>()),
+	_write_handler_memory(std::make_shared<HandlerMemory>()),
+	_max_message_size(SESSION_MAX_MESSAGE_SIZE),
 	_read_msgs_size(0),
-	_total_read_size(0),
-	OnConnectionError(nullptr)
+	_read_fd(-1),
+	_next_stream_id(0),
+	_current_request_id(0),
+	_is_compression_offered(false),
+	_is_peer_inflating(false),
+	_is_shared_memory_enabled(false),
+	_is_connect_pending(false),
+	_is_attached_sent(false),
+	_is_peer_attached(false),
+	_is_reading_shared_memory(false),
+	_is_writing_shared_memory(false),
+	_statistics_interval(0),
+	OnConnectionError(nullptr),
+	OnReceiveUpdate(nullptr),
+	OnSendUpdate(nullptr),
+	OnSendComplete(nullptr),
+	OnSendError(nullptr),
+	_com_thread(nullptr)
 {	
 }
 
 Session::Session(boost::asio::io_service* io_service, boost::asio::io_service::strand* strand)
-	: _io_service(io_service), 
-	_socket(new boost::asio::ip::tcp::socket(*_io_service)), 
+	: _io_service(io_service),
 	_strand(strand),
+	_socket(new boost::asio::ip::tcp::socket(*_io_service)),
+	_outbound_in_flight(0),
+	_is_writing(false),
+	_connection_id(0),
+	_read_handler_memory(std::make_shared<HandlerMemory>()),
+	_write_handler_memory(std::make_shared<HandlerMemory>()),
+	_max_message_size(SESSION_MAX_MESSAGE_SIZE),
+	_read_msgs_size(0),
+	_read_fd(-1),
+	_next_stream_id(0),
+	_current_request_id(0),
+	_is_compression_offered(false),
+	_is_peer_inflating(false),
+	_is_shared_memory_enabled(false),
+	_is_connect_pending(false),
+	_is_attached_sent(false),
+	_is_peer_attached(false),
+	_is_reading_shared_memory(false),
+	_is_writing_shared_memory(false),
+	_statistics_interval(0),
+	OnConnectionError(nullptr),
 	OnReceiveUpdate(nullptr),
-	OnSendUpdate(nullptr), 
+	OnSendUpdate(nullptr),
 	OnSendComplete(nullptr),
-	_write_msgs_size(0),
-	_total_write_size(0),
-	_read_msgs_size(0),
-	_total_read_size(0),
-	OnConnectionError(nullptr)
+	OnSendError(nullptr),
+	_com_thread(nullptr)
 {	
 }
 
 rtkcommunication::Session::Session(boost::asio::io_service *io_service, boost::asio::io_service::strand *strand, std::function<void(std::string)> OnConnectionError)
-	: _io_service(io_service), 
-	_socket(new boost::asio::ip::tcp::socket(*_io_service)), 
+	: _io_service(io_service),
 	_strand(strand),
+	_socket(new boost::asio::ip::tcp::socket(*_io_service)),
+	_outbound_in_flight(0),
+	_is_writing(false),
+	_connection_id(0),
+	_read_handler_memory(std::make_shared<HandlerMemory>()),
+	_write_handler_memory(std::make_shared<HandlerMemory>()),
+	_max_message_size(SESSION_MAX_MESSAGE_SIZE),
+	_read_msgs_size(0),
+	_read_fd(-1),
+	_next_stream_id(0),
+	_current_request_id(0),
+	_is_compression_offered(false),
+	_is_peer_inflating(false),
+	_is_shared_memory_enabled(false),
+	_is_connect_pending(false),
+	_is_attached_sent(false),
+	_is_peer_attached(false),
+	_is_reading_shared_memory(false),
+	_is_writing_shared_memory(false),
+	_statistics_interval(0),
+	OnConnectionError(WithErrorCode(OnConnectionError)),
 	OnReceiveUpdate(nullptr),
-	OnSendUpdate(nullptr), 
+	OnSendUpdate(nullptr),
 	OnSendComplete(nullptr),
-	_write_msgs_size(0),
-	_total_write_size(0),
-	_read_msgs_size(0),
-	_total_read_size(0),
-	OnConnectionError(OnConnectionError)
+	OnSendError(nullptr),
+	_com_thread(nullptr)
 {
 }
 
 Session::~Session()
 {
+	CloseReadFile();
+	ResetCompression();
+
+	// Joins the channel's threads, while the strand their handlers are dispatched to still exists
+	_shared_memory.reset();
+	_handshake_timer.reset();
+	_statistics_timer.reset();
+	_resolver.reset();
+
+	if (_socket != nullptr)
+		delete _socket;
+}
+
+std::shared_ptr<Session> Session::KeepAlive()
+{
+	return weak_from_this().lock();
+}
+
+boost::asio::ip::tcp::socket& Session::GetSocket()
+{
+	return *_socket;
+}
+
+void Session::Start()
+{
+}
+
+void Session::Connect(std::string ip, std::string port, std::function<void()> OnConnected, std::function<void(std::string)> OnConnectionError)
+{
+	Connect(ip, port, OnConnected, WithErrorCode(OnConnectionError));
+}
+
+void Session::Connect(std::string ip, std::string port, std::function<void()> OnConnected,
+	std::function<void(const boost::system::error_code&, std::string)> OnConnectionError)
+{
+	this->OnConnected = OnConnected;
+	this->OnConnectionError = OnConnectionError;
+
+	_ip = ip;
+	_port = port;
+
+	RunOnStrand(KeepAlive([this]() { Resolve(); }));
+}
+
+void Session::Reconnect(std::function<void()> OnConnected, std::function<void(std::string)> OnConnectionError)
+{
+	Reconnect(OnConnected, WithErrorCode(OnConnectionError));
+}
+
+void Session::Reconnect(std::function<void()> OnConnected, std::function<void(const boost::system::error_code&, std::string)> OnConnectionError)
+{
+	RunOnStrand(KeepAlive([this, OnConnected, OnConnectionError]()
+	{
+		Stop();
+
+		this->OnConnected = OnConnected;
+		this->OnConnectionError = OnConnectionError;
+
+		Resolve();
+	}));
+}
+
+void Session::RunOnStrand(std::function<void()> task)
+{
+	// Keeps a running io thread from returning while it is checked
+	boost::asio::io_service::work work(*_io_service);
+
+	if (_com_thread != nullptr && _io_service->stopped())
+	{
+		_com_thread->join();
+		delete _com_thread;
+		_com_thread = nullptr;
+
+		_io_service->restart();
+	}
+
+	_strand->post(task);
+
+	if (_com_thread == nullptr)
+		_com_thread = new boost::thread(boost::bind(&boost::asio::io_service::run, _io_service));
+}
+
+void Session::Resolve()
+{
+	if (_resolver == nullptr)
+		_resolver.reset(new boost::asio::ip::tcp::resolver(*_io_service));
+
+	_resolver->async_resolve(_ip, _port,
+		_strand->wrap(KeepAlive(OnCurrentConnection([this](const boost::system::error_code& error, boost::asio::ip::tcp::resolver::results_type endpoints)
+		{
+			HandleResolve(error, endpoints);
+		}))));
+}
+
+void Session::HandleResolve(const boost::system::error_code& error, boost::asio::ip::tcp::resolver::results_type endpoints)
+{
+	if (!error)
+	{
+		boost::asio::async_connect(*_socket, endpoints,
+			_strand->wrap(KeepAlive(OnCurrentConnection([this](const boost::system::error_code& error, const boost::asio::ip::tcp::endpoint&)
+			{
+				HandleConnect(error);
+			}))));
+	}
+	else
+	{
+		std::cerr << error.message() << std::endl;
+
+		if (OnConnectionError != nullptr)
+		{
+			OnConnectionError(error, error.message());
+		}
+	}
+}
+
+void Session::HandleConnect(const boost::system::error_code& error)
+{
+	if (!error)
+	{
+		int yes = 1;
+		setsockopt(_socket->native_handle(), SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(int));
+
+		int idle = 10;
+		setsockopt(_socket->native_handle(), IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(int));
+
+		int interval = 10;
+		setsockopt(_socket->native_handle(), IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(int));
+
+		int maxpkt = 1000000;
+		setsockopt(_socket->native_handle(), IPPROTO_TCP, TCP_KEEPCNT, &maxpkt, sizeof(int));
+
+		// Frames are compressed on the sending threads once the peer's Hello says it inflates them, until then nothing is
+		ResetCompression();
+
+		{
+			std::lock_guard<std::mutex> lock(_statistics_mutex);
+			_statistics = SessionStatistics();
+			_connect_time = std::chrono::steady_clock::now();
+		}
+
+		_logged_statistics = SessionStatistics();
+
+		if (_statistics_interval > 0)
+		{
+			_statistics_timer.reset(new boost::asio::steady_timer(*_io_service));
+			LogStatistics();
+		}
+
+		_shared_memory.reset();
+		_handshake_timer.reset();
+		_is_attached_sent = false;
+		_is_peer_attached = false;
+		_is_reading_shared_memory = false;
+		_is_writing_shared_memory = false;
+
+		if (_is_shared_memory_enabled && IsPeerLocal())
+		{
+			_shared_memory.reset(new SharedMemoryChannel());
+
+			if (_shared_memory->Create() == false)
+				_shared_memory.reset();
+		}
+
+		if (_is_compression_offered || _shared_memory != nullptr)
+		{
+			uint32_t capabilities = (_is_compression_offered ? SESSION_CAPABILITY_DEFLATE : 0) | (_shared_memory != nullptr ? SESSION_CAPABILITY_SHARED_MEMORY : 0);
+
+			std::vector<char> hello((const char*)&capabilities, (const char*)&capabilities + sizeof(uint32_t));
+
+			if (_shared_memory != nullptr)
+			{
+				uint64_t token = _shared_memory->GetToken();
+				hello.insert(hello.end(), (const char*)&token, (const char*)&token + sizeof(uint64_t));
+				hello.insert(hello.end(), _shared_memory->GetName().begin(), _shared_memory->GetName().end());
+			}
+
+			QueueMessage(MessageType::Hello, 0, std::make_shared<const std::vector<char>>(std::move(hello)));
+		}
+
+		// With shared memory on offer the application starts writing once the handshake has decided where its messages go
+		_is_connect_pending = _shared_memory != nullptr;
+
+		if (_is_connect_pending)
+		{
+			// A peer which does not know the handshake never answers
+			_handshake_timer.reset(new boost::asio::steady_timer(*_io_service, std::chrono::milliseconds(SHARED_MEMORY_HANDSHAKE_TIMEOUT)));
+			_handshake_timer->async_wait(_strand->wrap(KeepAlive([this](const boost::system::error_code& error)
+			{
+				// Once the peer's Hello is in, its answer is certain to follow, so the deadline is moved out of reach
+				if (!error && _shared_memory != nullptr && _handshake_timer->expiry() <= std::chrono::steady_clock::now())
+					HandleSharedMemoryAttached(false);
+			})));
+		}
+
+		if (OnConnected && !_is_connect_pending)
+		{
+			OnConnected();
+		}
+
+		ReadMessage([this](const char* data, size_t size) { HandleRequests(data, size); });
+	}
+	else
+	{
+		std::cerr << error.message() << std::endl;
+
+		if (OnConnectionError)
+		{
+			OnConnectionError(error, error.message());
+		}
+	}
+}
+
+void Session::HandleRequests(const char* data, size_t size)
+{
+	std::string msg(data, data + size);
+
+	SPDLOG_LOGGER_DEBUG(spdlog::get("rtkcommunication"), "Session received: {}.", msg);
+
+	ReadMessage([this](const char* data, size_t size) { HandleRequests(data, size); });
+}
+
+void Session::ReadMessage(std::function<void(const char*, size_t)> callback)
+{
+	// Parked in the session while the read is outstanding, so the handler stays small enough for the recycled memory
+	_read_callback = std::move(callback);
+
+	AsyncRead(boost::asio::buffer(&_read_header, sizeof(_read_header)),
+		BindRead([this](const boost::system::error_code& error, size_t bytes_transferred)
+		{
+			HandleReadHeader(error, bytes_transferred, std::move(_read_callback));
+		}));
+}
+
+void Session::HandleReadHeader(const boost::system::error_code& error, size_t, std::function<void(const char*, size_t)> callback)
+{
+	if (!error)
+	{
+		_read_header_time = std::chrono::steady_clock::now();
+
+		// The header holds the total size including itself; it comes from the peer, so it is checked before a buffer of that size is allocated
+		if (_read_header.length < sizeof(MessageHeader) || _read_header.length - sizeof(MessageHeader) > _max_message_size)
+		{
+			CloseConnection(boost::system::errc::make_error_code(boost::system::errc::protocol_error), "Invalid message size " + std::to_string(_read_header.length));
+			return;
+		}
+
+		size_t payload_size = _read_header.length - sizeof(MessageHeader);
+		_read_buffer = _read_buffer_pool.Acquire(payload_size);
+
+		_read_callback = std::move(callback);
+
+		AsyncRead(boost::asio::buffer(_read_buffer.data.get(), payload_size),
+			BindRead([this](const boost::system::error_code& error, size_t bytes_transferred)
+			{
+				HandleRead(error, bytes_transferred, std::move(_read_callback));
+			}));
+	}
+	else
+	{
+		FailConnection(error, error.message());
+	}
+}
+
+void Session::HandleRead(const boost::system::error_code& error, size_t bytes_transferred, std::function<void(const char*, size_t)> callback)
+{
+	if (!error)
+	{
+		// The next ReadMessage started by the callback only touches '_read_buffer' in a later handler on the strand
+		PooledBuffer buffer = std::move(_read_buffer);
+
+		if (_read_header.flags & MESSAGE_FLAG_COMPRESSED)
+		{
+			PooledBuffer inflated_buffer;
+			if (Inflate(buffer.data.get(), bytes_transferred, inflated_buffer, bytes_transferred) == false)
+			{
+				CloseConnection(boost::system::errc::make_error_code(boost::system::errc::protocol_error), "Failed to decompress message");
+				return;
+			}
+
+			_read_buffer_pool.Release(std::move(buffer));
+			buffer = std::move(inflated_buffer);
+		}
+
+		{
+			double assembly_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - _read_header_time).count();
+
+			std::lock_guard<std::mutex> lock(_statistics_mutex);
+			_statistics.bytes_received += _read_header.length;
+			_statistics.messages_received++;
+			_statistics.assembly_time_total += assembly_time;
+			_statistics.assembly_time_max = std::max(_statistics.assembly_time_max, assembly_time);
+		}
+
+		if (_read_header.type == (uint16_t)MessageType::Hello)
+		{
+			uint32_t capabilities = 0;
+			if (bytes_transferred >= sizeof(uint32_t))
+				memcpy(&capabilities, buffer.data.get(), sizeof(uint32_t));
+
+			// Only compress if both peers asked for it
+			_is_peer_inflating = _is_compression_offered && (capabilities & SESSION_CAPABILITY_DEFLATE) != 0;
+
+			if ((capabilities & SESSION_CAPABILITY_SHARED_MEMORY) != 0 && bytes_transferred > sizeof(uint32_t) + sizeof(uint64_t))
+			{
+				uint32_t is_attached = 0;
+
+				if (_shared_memory != nullptr)
+				{
+					uint64_t token;
+					memcpy(&token, buffer.data.get() + sizeof(uint32_t), sizeof(uint64_t));
+					std::string name(buffer.data.get() + sizeof(uint32_t) + sizeof(uint64_t), buffer.data.get() + bytes_transferred);
+
+					is_attached = _shared_memory->Attach(name, token) ? 1 : 0;
+					_handshake_timer->expires_at(boost::asio::steady_timer::time_point::max());
+				}
+
+				// The peer waits for this answer even if we offered nothing; if it maps our ring too, this is the last message we send over the socket
+				QueueMessage(MessageType::SharedMemoryAttached, 0, std::make_shared<const std::vector<char>>((const char*)&is_attached, (const char*)&is_attached + sizeof(uint32_t)));
+			}
+			else if (_shared_memory != nullptr)
+			{
+				HandleSharedMemoryAttached(false);
+			}
+
+			_read_buffer_pool.Release(std::move(buffer));
+
+			ReadMessage(std::move(callback));
+			return;
+		}
+
+		if (_read_header.type == (uint16_t)MessageType::SharedMemoryAttached)
+		{
+			uint32_t is_attached = 0;
+			if (bytes_transferred >= sizeof(uint32_t))
+				memcpy(&is_attached, buffer.data.get(), sizeof(uint32_t));
+
+			_read_buffer_pool.Release(std::move(buffer));
+
+			if (_shared_memory != nullptr)
+				HandleSharedMemoryAttached(is_attached == 1);
+
+			// Already from the channel, if the peer writes there from now on
+			ReadMessage(std::move(callback));
+			return;
+		}
+
+		if (_read_header.type == (uint16_t)MessageType::Response)
+		{
+			// Responses go to the request they belong to, in whatever order they arrive; the application keeps receiving its own messages
+			auto it = _pending_requests.find(_read_header.stream_id);
+
+			if (it != _pending_requests.end())
+			{
+				PendingRequest request = std::move(it->second);
+				_pending_requests.erase(it);
+
+				request.OnResponse(buffer.data.get(), bytes_transferred);
+			}
+
+			_read_buffer_pool.Release(std::move(buffer));
+
+			ReadMessage(std::move(callback));
+			return;
+		}
+
+		// Kept aside, the callback may start reading the next header before it responds
+		_current_request_id = _read_header.type == (uint16_t)MessageType::Request ? _read_header.stream_id : 0;
+
+		callback(buffer.data.get(), bytes_transferred);
+		_read_buffer_pool.Release(std::move(buffer));
+	}
+	else
+	{
+		FailConnection(error, error.message());
+	}
+}
+
+void Session::ReadFolder(Folder& folder, std::function<void()> callback)
+{
+	_read_msgs_size = 0;
+
+	// Create every directory of the folder up front instead of once per received chunk
+	std::set<std::filesystem::path> directories;
+	for (const File& file : folder.files)
+		directories.insert(std::filesystem::path(TEMP_FOLDER + folder.GetFolderName() + "/" + file.file_name).parent_path());
+
+	for (const std::filesystem::path& directory : directories)
+		std::filesystem::create_directories(directory);
+
+	// Every chunk continues on the session's copy instead of carrying one along in its handler
+	_read_folder = folder;
+
+	HandleReadFolder(boost::system::error_code(), 0, _read_folder, std::move(callback));
+}
+
+void Session::HandleReadFolder(const boost::system::error_code& error, size_t bytes_transferred, Folder& folder, std::function<void()> callback)
+{
+	if (!error)
+	{
+		if (bytes_transferred > 0)
+		{
+			File& file = folder.files[folder.rcvd_files];
+
+			size_t written_size = 0;
+			while (written_size < bytes_transferred)
+			{
+				ssize_t result = pwrite(_read_fd, _read_msg.data() + written_size, bytes_transferred - written_size, file.rcvd_size + written_size);
+
+				if (result < 0 && errno == EINTR)
+					continue;
+
+				if (result < 0)
+				{
+					boost::system::error_code write_error(errno, boost::system::system_category());
+					CloseReadFile();
+					CloseConnection(write_error, "Failed to write " + file.file_name + ": " + write_error.message());
+					return;
+				}
+
+				written_size += result;
+			}
+
+			file.rcvd_size += bytes_transferred;
+			_read_msgs_size += bytes_transferred;
+
+			{
+				std::lock_guard<std::mutex> lock(_statistics_mutex);
+				_statistics.bytes_received += bytes_transferred;
+			}
+
+			if (file.rcvd_size >= file.size)
+				CloseReadFile();
+
+			if (OnReceiveUpdate)
+				OnReceiveUpdate((float)_read_msgs_size / (float)folder.GetTotalSize() * 100);
+		}
+
+		// Files are sent back to back without padding, so skip the completed ones; empty files carry no bytes at all
+		while (folder.rcvd_files < folder.files.size() && folder.files[folder.rcvd_files].rcvd_size >= folder.files[folder.rcvd_files].size)
+		{
+			File& file = folder.files[folder.rcvd_files];
+
+			if (file.size == 0)
+			{
+				std::string filepath = TEMP_FOLDER + folder.GetFolderName() + "/" + file.file_name;
+				int fd = open(filepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+				if (fd >= 0)
+					close(fd);
+			}
+
+			folder.rcvd_files++;
+		}
+
+		if (folder.rcvd_files == folder.files.size())
+		{
+			{
+				std::lock_guard<std::mutex> lock(_statistics_mutex);
+				_statistics.messages_received++;
+			}
+
+			callback();
+			return;
+		}
+
+		File& file = folder.files[folder.rcvd_files];
+
+		if (_read_fd < 0)
+		{
+			std::string filepath = TEMP_FOLDER + folder.GetFolderName() + "/" + file.file_name;
+			_read_fd = open(filepath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (file.rcvd_size == 0 ? O_TRUNC : 0), 0644);
+
+			if (_read_fd < 0)
+			{
+				boost::system::error_code open_error(errno, boost::system::system_category());
+				CloseConnection(open_error, "Failed to open " + filepath + ": " + open_error.message());
+				return;
+			}
+
+			// Reserve the whole file at once so the filesystem can lay it out contiguously; the size only grows as data arrives.
+			// Not every filesystem supports it, in which case the blocks are allocated by pwrite as usual
+			fallocate(_read_fd, FALLOC_FL_KEEP_SIZE, 0, file.size);
+		}
+
+		size_t read_size = file.size - file.rcvd_size > MAX_IP_PACK_SIZE ? MAX_IP_PACK_SIZE : file.size - file.rcvd_size;
+
+		_read_folder_callback = std::move(callback);
+
+		AsyncRead(boost::asio::buffer(_read_msg, read_size),
+			BindRead([this, &folder](const boost::system::error_code& error, size_t bytes_transferred)
+			{
+				HandleReadFolder(error, bytes_transferred, folder, std::move(_read_folder_callback));
+			}));
+	}
+	else
+	{
+		CloseReadFile();
+		FailConnection(error, error.message());
+	}
+}
+
+void Session::ReadFolderInterleaved(std::shared_ptr<FolderReceiver> receiver, std::function<void()> callback)
+{
+	_read_folder_callback = std::move(callback);
+
+	AsyncRead(boost::asio::buffer(&_read_chunk_header, sizeof(FolderChunkHeader)),
+		BindRead([this, receiver = std::move(receiver)](const boost::system::error_code& error, size_t bytes_transferred)
+		{
+			HandleReadChunkHeader(error, bytes_transferred, receiver, std::move(_read_folder_callback));
+		}));
+}
+
+void Session::HandleReadChunkHeader(const boost::system::error_code& error, size_t bytes_transferred, std::shared_ptr<FolderReceiver> receiver, std::function<void()> callback)
+{
+	if (!error)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_statistics_mutex);
+			_statistics.bytes_received += bytes_transferred;
+
+			if (_read_chunk_header.file_id == FOLDER_END_OF_STREAM)
+				_statistics.messages_received++;
+		}
+
+		if (_read_chunk_header.file_id == FOLDER_END_OF_STREAM)
+		{
+			callback();
+			return;
+		}
+
+		// The length comes from the peer and is read into '_read_msg', so a chunk that does not fit the folder ends the connection
+		if (receiver->IsValidChunk(_read_chunk_header) == false)
+		{
+			CloseConnection(boost::system::errc::make_error_code(boost::system::errc::protocol_error), "Invalid folder chunk of file " + std::to_string(_read_chunk_header.file_id));
+			return;
+		}
+
+		_read_folder_callback = std::move(callback);
+
+		AsyncRead(boost::asio::buffer(_read_msg, _read_chunk_header.length),
+			BindRead([this, receiver = std::move(receiver)](const boost::system::error_code& error, size_t bytes_transferred)
+			{
+				HandleReadChunk(error, bytes_transferred, receiver, std::move(_read_folder_callback));
+			}));
+	}
+	else
+	{
+		FailConnection(error, error.message());
+	}
+}
+
+void Session::HandleReadChunk(const boost::system::error_code& error, size_t bytes_transferred, std::shared_ptr<FolderReceiver> receiver, std::function<void()> callback)
+{
+	if (!error)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_statistics_mutex);
+			_statistics.bytes_received += bytes_transferred;
+		}
+
+		if (receiver->WriteChunk(_read_chunk_header, _read_msg.data()) == false)
+		{
+			CloseConnection(boost::system::errc::make_error_code(boost::system::errc::io_error), "Failed to write folder chunk of file " + std::to_string(_read_chunk_header.file_id));
+			return;
+		}
+
+		if (OnReceiveUpdate)
+			OnReceiveUpdate(receiver->GetProgress());
+
+		ReadFolderInterleaved(std::move(receiver), std::move(callback));
+	}
+	else
+	{
+		FailConnection(error, error.message());
+	}
+}
+
+void Session::CloseReadFile()
+{
+	if (_read_fd >= 0)
+	{
+		close(_read_fd);
+		_read_fd = -1;
+	}
+}
+
+void Session::StartWrite()
+{
+	_is_writing = true;
+	_write_buffers.clear();
+	_outbound_in_flight = 0;
+
+	if (_outbound_msgs.front().folder != nullptr)
+	{
+		_outbound_in_flight = 1;
+		SendFolderChunk();
+		return;
+	}
+
+	// Coalesce queued messages into one gather write; a large message goes out alone
+	size_t coalesced_size = 0;
+	for (OutboundMessage& msg : _outbound_msgs)
+	{
+		if (msg.folder != nullptr || _outbound_in_flight == MAX_COALESCED_MESSAGES || (_outbound_in_flight > 0 && coalesced_size + msg.header.length > MAX_COALESCED_BYTES))
+			break;
+
+		_write_buffers.push_back(boost::asio::buffer(&msg.header, sizeof(MessageHeader)));
+		_write_buffers.push_back(boost::asio::buffer(*msg.payload));
+		coalesced_size += msg.header.length;
+		_outbound_in_flight++;
+
+		// The messages behind it may have to go through shared memory
+		if (msg.header.type == (uint16_t)MessageType::SharedMemoryAttached)
+			break;
+	}
+
+	// References to deque elements stay valid while other messages are pushed to the back
+	AsyncWrite(_write_buffers,
+		BindWrite([this](const boost::system::error_code& error, size_t bytes_transferred)
+		{
+			HandleWrite(error, bytes_transferred);
+		}));
+}
+
+void Session::HandleWrite(const boost::system::error_code& error, size_t bytes_transferred)
+{
+	if (!error)
+	{
+		if (_outbound_in_flight > 0 && _outbound_msgs[_outbound_in_flight - 1].header.type == (uint16_t)MessageType::SharedMemoryAttached)
+		{
+			_is_attached_sent = true;
+			_is_writing_shared_memory = _is_peer_attached;
+		}
+
+		{
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+			std::lock_guard<std::mutex> lock(_statistics_mutex);
+			_statistics.bytes_sent += bytes_transferred;
+			_statistics.messages_sent += _outbound_in_flight;
+			_statistics.queue_depth = _outbound_msgs.size() - _outbound_in_flight;
+
+			for (size_t i = 0; i < _outbound_in_flight; i++)
+			{
+				double latency = std::chrono::duration<double>(now - _outbound_msgs[i].queued_time).count();
+				_statistics.write_latency_total += latency;
+				_statistics.write_latency_max = std::max(_statistics.write_latency_max, latency);
+				_statistics.queued_bytes -= _outbound_msgs[i].header.length;
+			}
+		}
+
+		_outbound_msgs.erase(_outbound_msgs.begin(), _outbound_msgs.begin() + _outbound_in_flight);
+
+		if (!_outbound_msgs.empty())
+			StartWrite();
+		else
+			_is_writing = false;
+	}
+	else
+	{
+		ClearOutboundQueue();
+		FailConnection(error, error.message());
+	}
+}
+
+void Session::ClearOutboundQueue()
+{
+	for (OutboundMessage& msg : _outbound_msgs)
+	{
+		if (msg.folder != nullptr)
+			CloseFolderFiles(*msg.folder);
+	}
+
+	_outbound_msgs.clear();
+	_outbound_in_flight = 0;
+	_is_writing = false;
+
+	std::lock_guard<std::mutex> lock(_statistics_mutex);
+	_statistics.queue_depth = 0;
+	_statistics.queued_bytes = 0;
+}
+
+void Session::SendFolderChunk()
+{
+	FolderTransfer& transfer = *_outbound_msgs.front().folder;
+
+	if (transfer.chunk_remaining == 0)
+	{
+		// The bytes of a plain transfer can't be skipped once the receiver reads them, so every file is checked before the first byte goes out
+		if (!transfer.is_interleaved && transfer.next_file == 0 && transfer.sent_size == 0)
+		{
+			for (FolderTransfer::FileState& file : transfer.files)
+			{
+				struct stat file_stat;
+
+				if (stat(file.path.c_str(), &file_stat) != 0)
+				{
+					FailFolderTransfer("File not found: " + file.path);
+					return;
+				}
+
+				if ((size_t)file_stat.st_size < file.size)
+				{
+					FailFolderTransfer("File truncated: " + file.path);
+					return;
+				}
+			}
+		}
+
+		// Open files until the set of files sent side by side is full
+		while (transfer.active_files.size() < transfer.max_active_files && transfer.next_file < transfer.files.size())
+		{
+			FolderTransfer::FileState& file = transfer.files[transfer.next_file];
+
+			// Empty files carry no bytes, the receiver creates them from the folder description; fully received files are not sent again
+			SkipValidChunks(file);
+			if ((size_t)file.offset < file.size)
+			{
+				file.fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+
+				if (file.fd < 0)
+				{
+					FailFolderTransfer("Failed to open " + file.path + ": " + strerror(errno));
+					return;
+				}
+
+				// Tell the kernel the file is read once from start to end, so readahead keeps sendfile fed
+				posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+				transfer.active_files.push_back(transfer.next_file);
+			}
+
+			transfer.next_file++;
+		}
+
+		if (transfer.active_files.empty())
+		{
+			if (transfer.is_interleaved && !transfer.is_end_sent)
+			{
+				transfer.chunk_header = { FOLDER_END_OF_STREAM, 0, 0, 0, 0 };
+				transfer.is_end_sent = true;
+				SendFolderChunkHeader();
+				return;
+			}
+
+			FinishFolderTransfer(boost::system::error_code());
+			return;
+		}
+
+		if (transfer.current_file >= transfer.active_files.size())
+			transfer.current_file = 0;
+
+		FolderTransfer::FileState& file = transfer.files[transfer.active_files[transfer.current_file]];
+		size_t remaining = file.size - file.offset;
+
+		if (transfer.is_interleaved)
+		{
+			transfer.chunk_remaining = remaining > FOLDER_CHUNK_SIZE ? FOLDER_CHUNK_SIZE : remaining;
+			SendFolderFramedChunk();
+			return;
+		}
+
+		// Without frames the whole file is one chunk
+		transfer.chunk_remaining = remaining;
+	}
+
+	FolderTransfer::FileState& file = transfer.files[transfer.active_files[transfer.current_file]];
+	size_t chunk_size = transfer.chunk_remaining > FOLDER_SEND_WINDOW ? FOLDER_SEND_WINDOW : transfer.chunk_remaining;
+
+	if (transfer.use_sendfile && _is_writing_shared_memory)
+	{
+		// There is no socket to send the file to, it is copied into the ring through the window buffer instead
+		transfer.use_sendfile = false;
+		transfer.window.resize(std::max(transfer.window.size(), (size_t)FOLDER_SEND_WINDOW));
+	}
+
+	ssize_t sent = -1;
+	if (transfer.use_sendfile)
+	{
+		// Straight from the page cache into the socket, the file contents never pass through user space
+		sent = SendFileNoSignal(_socket->native_handle(), file.fd, &file.offset, chunk_size);
+		CountCall(_statistics.write_calls);
+
+		if (sent < 0 && (errno == EINVAL || errno == ENOSYS))
+		{
+			// Some filesystems do not support sendfile, fall back to reading through the window buffer
+			transfer.use_sendfile = false;
+			transfer.window.resize(std::max(transfer.window.size(), (size_t)FOLDER_SEND_WINDOW));
+		}
+		else if (sent < 0 && errno != EAGAIN && errno != EINTR)
+		{
+			// The socket failed (peer closed or reset it), the receiver can't take the rest of the folder
+			boost::system::error_code send_error(errno, boost::system::system_category());
+			std::string message = "Failed to send " + file.path + ": " + send_error.message();
+
+			ClearOutboundQueue();
+			CloseConnection(send_error, message);
+			return;
+		}
+	}
+
+	if (!transfer.use_sendfile)
+	{
+		sent = pread(file.fd, transfer.window.data(), chunk_size, file.offset);
+
+		if (sent <= 0)
+		{
+			FailFolderTransfer(sent == 0 ? "File truncated: " + file.path : "Failed to read " + file.path + ": " + strerror(errno));
+			return;
+		}
+
+		AsyncWrite(boost::asio::buffer(transfer.window.data(), sent),
+			BindWrite([this](const boost::system::error_code& error, size_t bytes_transferred)
+			{
+				if (error)
+				{
+					FinishFolderTransfer(error);
+					return;
+				}
+
+				FolderTransfer& transfer = *_outbound_msgs.front().folder;
+				transfer.files[transfer.active_files[transfer.current_file]].offset += bytes_transferred;
+				OnFolderChunkSent(bytes_transferred);
+			}));
+		return;
+	}
+
+	if (sent < 0)
+	{
+		// Socket buffer is full, continue once the socket is writable again
+		_socket->async_wait(boost::asio::ip::tcp::socket::wait_write,
+			BindWrite([this](const boost::system::error_code& error)
+			{
+				if (error)
+					FinishFolderTransfer(error);
+				else
+					SendFolderChunk();
+			}));
+		return;
+	}
+
+	// The file ended before its announced size, another call would return 0 again
+	if (sent == 0)
+	{
+		FailFolderTransfer("File truncated: " + file.path);
+		return;
+	}
+
+	OnFolderChunkSent(sent);
+}
+
+void Session::SendFolderChunkHeader()
+{
+	FolderTransfer& transfer = *_outbound_msgs.front().folder;
+
+	AsyncWrite(boost::asio::buffer(&transfer.chunk_header, sizeof(FolderChunkHeader)),
+		BindWrite([this](const boost::system::error_code& error, size_t)
+		{
+			if (error)
+				FinishFolderTransfer(error);
+			else
+				SendFolderChunk();
+		}));
+}
+
+void Session::SendFolderFramedChunk()
+{
+	FolderTransfer& transfer = *_outbound_msgs.front().folder;
+	FolderTransfer::FileState& file = transfer.files[transfer.active_files[transfer.current_file]];
+
+	// The checksum needs the bytes in user space, so framed chunks are read into the window instead of using sendfile
+	size_t read_size = 0;
+	while (read_size < transfer.chunk_remaining)
+	{
+		ssize_t result = pread(file.fd, transfer.window.data() + read_size, transfer.chunk_remaining - read_size, file.offset + read_size);
+
+		if (result < 0 && errno == EINTR)
+			continue;
+
+		if (result <= 0)
+		{
+			FailFolderTransfer(result == 0 ? "File truncated: " + file.path : "Failed to read " + file.path + ": " + strerror(errno));
+			return;
+		}
+
+		read_size += result;
+	}
+
+	transfer.chunk_header = { file.file_id, (uint32_t)transfer.chunk_remaining, (uint64_t)file.offset, Crc32c(transfer.window.data(), transfer.chunk_remaining), 0 };
+
+	_write_buffers.clear();
+	_write_buffers.push_back(boost::asio::buffer(&transfer.chunk_header, sizeof(FolderChunkHeader)));
+	_write_buffers.push_back(boost::asio::buffer(transfer.window.data(), transfer.chunk_remaining));
+
+	AsyncWrite(_write_buffers,
+		BindWrite([this](const boost::system::error_code& error, size_t)
+		{
+			if (error)
+			{
+				FinishFolderTransfer(error);
+				return;
+			}
+
+			FolderTransfer& transfer = *_outbound_msgs.front().folder;
+			size_t chunk_size = transfer.chunk_remaining;
+
+			transfer.files[transfer.active_files[transfer.current_file]].offset += chunk_size;
+			OnFolderChunkSent(chunk_size);
+		}));
+}
+
+void Session::SkipValidChunks(FolderTransfer::FileState& file)
+{
+	while ((size_t)file.offset < file.size && file.offset / FOLDER_CHUNK_SIZE < (off_t)file.valid_chunks.size() && file.valid_chunks[file.offset / FOLDER_CHUNK_SIZE])
+		file.offset = std::min(file.offset + FOLDER_CHUNK_SIZE, (off_t)file.size);
+}
+
+void Session::OnFolderChunkSent(size_t bytes_sent)
+{
+	FolderTransfer& transfer = *_outbound_msgs.front().folder;
+	transfer.sent_size += bytes_sent;
+	transfer.chunk_remaining -= bytes_sent;
+
+	if (transfer.chunk_remaining == 0)
+	{
+		FolderTransfer::FileState& file = transfer.files[transfer.active_files[transfer.current_file]];
+		SkipValidChunks(file);
+
+		if ((size_t)file.offset == file.size)
+		{
+			close(file.fd);
+			file.fd = -1;
+
+			// The next active file moves into 'current_file'
+			transfer.active_files.erase(transfer.active_files.begin() + transfer.current_file);
+		}
+		else
+		{
+			transfer.current_file++;
+		}
+	}
+
+	if (OnSendUpdate && transfer.total_size > 0)
+		OnSendUpdate((float)transfer.sent_size / (float)transfer.total_size * 100);
+
+	// Yield to other handlers on the strand between chunks instead of looping here
+	_strand->post(KeepAlive([this]() { SendFolderChunk(); }));
+}
+
+void Session::FinishFolderTransfer(const boost::system::error_code& error)
+{
+	std::shared_ptr<FolderTransfer> transfer = _outbound_msgs.front().folder;
+
+	CloseFolderFiles(*transfer);
+
+	if (!error)
+	{
+		if (!transfer->error.empty())
+		{
+			if (OnSendError)
+				OnSendError(transfer->error);
+		}
+		else if (OnSendComplete)
+		{
+			OnSendComplete();
+		}
+
+		OnSendComplete = nullptr;
+		OnSendUpdate = nullptr;
+	}
+
+	HandleWrite(error, transfer->sent_size);
+}
+
+void Session::FailFolderTransfer(std::string error)
+{
+	FolderTransfer& transfer = *_outbound_msgs.front().folder;
+
+	std::cerr << error << std::endl;
+
+	if (!transfer.is_interleaved && transfer.sent_size > 0)
+	{
+		// The receiver would take whatever is sent next for the rest of the folder
+		ClearOutboundQueue();
+		CloseConnection(boost::system::errc::make_error_code(boost::system::errc::io_error), error);
+		return;
+	}
+
+	CloseFolderFiles(transfer);
+	transfer.next_file = transfer.files.size();
+	transfer.chunk_remaining = 0;
+	transfer.error = error;
+
+	// With nothing left to send, an interleaved transfer sends its FOLDER_END_OF_STREAM header and the transfer finishes
+	SendFolderChunk();
+}
+
+void Session::CloseFolderFiles(FolderTransfer& transfer)
+{
+	for (size_t index : transfer.active_files)
+	{
+		close(transfer.files[index].fd);
+		transfer.files[index].fd = -1;
+	}
+	transfer.active_files.clear();
+}
+
+void Session::Write(const char* msg, size_t size)
+{
+	// The caller keeps ownership of 'msg', so it has to be copied once to outlive the asynchronous write
+	Write(std::make_shared<const std::vector<char>>(msg, msg + size));
+}
+
+void Session::Write(std::vector<char>&& msg)
+{
+	Write(std::make_shared<const std::vector<char>>(std::move(msg)));
+}
+
+void Session::Write(SharedBuffer msg)
+{
+	std::chrono::steady_clock::time_point queued_time = std::chrono::steady_clock::now();
+	uint16_t flags = Compress(msg);
+
+	// Header and payload go out in one gather write, straight from their own memory. Queueing happens on the strand,
+	// so any number of threads can write concurrently and return immediately.
+	_strand->post([this, self = KeepAlive(), msg = std::move(msg), flags, queued_time]() mutable
+	{
+		QueueMessage(MessageType::Message, 0, std::move(msg), queued_time, flags);
+	});
+}
+
+std::future<std::vector<char>> Session::SendRequest(const char* msg, size_t size)
+{
+	return SendRequest(std::make_shared<const std::vector<char>>(msg, msg + size));
+}
+
+std::future<std::vector<char>> Session::SendRequest(SharedBuffer msg)
+{
+	std::shared_ptr<std::promise<std::vector<char>>> response = std::make_shared<std::promise<std::vector<char>>>();
+	std::future<std::vector<char>> result = response->get_future();
+
+	SendRequest(std::move(msg),
+		[response](const char* data, size_t size) { response->set_value(std::vector<char>(data, data + size)); },
+		[response](std::string error) { response->set_exception(std::make_exception_ptr(std::runtime_error(error))); });
+
+	return result;
+}
+
+void Session::SendRequest(SharedBuffer msg, std::function<void(const char*, size_t)> OnResponse, std::function<void(std::string)> OnError)
+{
+	std::chrono::steady_clock::time_point queued_time = std::chrono::steady_clock::now();
+	uint16_t flags = Compress(msg);
+
+	_strand->post([this, self = KeepAlive(), msg = std::move(msg), flags, OnResponse, OnError, queued_time]() mutable
+	{
+		// Stream id 0 marks messages that are not requests
+		if (++_next_stream_id == 0)
+			++_next_stream_id;
+
+		_pending_requests[_next_stream_id] = { OnResponse, OnError };
+		QueueMessage(MessageType::Request, _next_stream_id, std::move(msg), queued_time, flags);
+	});
+}
+
+void Session::Respond(uint32_t request_id, const char* msg, size_t size)
+{
+	Respond(request_id, std::make_shared<const std::vector<char>>(msg, msg + size));
+}
+
+void Session::Respond(uint32_t request_id, SharedBuffer msg)
+{
+	std::chrono::steady_clock::time_point queued_time = std::chrono::steady_clock::now();
+	uint16_t flags = Compress(msg);
+
+	_strand->post([this, self = KeepAlive(), request_id, msg = std::move(msg), flags, queued_time]() mutable
+	{
+		QueueMessage(MessageType::Response, request_id, std::move(msg), queued_time, flags);
+	});
+}
+
+uint32_t Session::GetRequestId() const
+{
+	return _current_request_id;
+}
+
+void Session::QueueMessage(MessageType type, uint32_t stream_id, SharedBuffer msg, std::chrono::steady_clock::time_point queued_time, uint16_t flags)
+{
+	MessageHeader header = { msg->size() + sizeof(MessageHeader), stream_id, (uint16_t)type, flags };
+	_outbound_msgs.push_back({ header, std::move(msg), nullptr, queued_time });
+
+	{
+		std::lock_guard<std::mutex> lock(_statistics_mutex);
+		_statistics.queue_depth = _outbound_msgs.size();
+		_statistics.queued_bytes += header.length;
+	}
+
+	if (!_is_writing)
+		StartWrite();
+}
+
+void Session::EnableCompression(bool is_enabled)
+{
+	_is_compression_offered = is_enabled;
+}
+
+void Session::EnableSharedMemory(bool is_enabled)
+{
+	_is_shared_memory_enabled = is_enabled;
+}
+
+void Session::SetMaxMessageSize(size_t max_message_size)
+{
+	_max_message_size = max_message_size;
+}
+
+SessionStatistics Session::GetStatistics() const
+{
+	std::lock_guard<std::mutex> lock(_statistics_mutex);
+
+	SessionStatistics statistics = _statistics;
+	if (_connect_time != std::chrono::steady_clock::time_point())
+		statistics.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - _connect_time).count();
+
+	return statistics;
+}
+
+void Session::EnableStatisticsLogging(int interval)
+{
+	_statistics_interval = interval;
+}
+
+void Session::CountCall(uint64_t& calls)
+{
+	std::lock_guard<std::mutex> lock(_statistics_mutex);
+	calls++;
+}
+
+void Session::LogStatistics()
+{
+	_statistics_timer->expires_after(std::chrono::milliseconds(_statistics_interval));
+	_statistics_timer->async_wait(_strand->wrap(KeepAlive([this](const boost::system::error_code& error)
+	{
+		// Stops with the connection, or the timer would keep the session alive
+		if (error || _socket->is_open() == false)
+			return;
+
+		SessionStatistics statistics = GetStatistics();
+		const SessionStatistics& logged = _logged_statistics;
+
+		// Rates and averages over the last interval, maxima since connecting
+		double interval = std::max(statistics.elapsed - logged.elapsed, 1e-9);
+		uint64_t messages_sent = statistics.messages_sent - logged.messages_sent;
+		uint64_t messages_received = statistics.messages_received - logged.messages_received;
+		double per_message_sent = messages_sent > 0 ? 1.0 / messages_sent : 0;
+		double per_message_received = messages_received > 0 ? 1.0 / messages_received : 0;
+
+		std::shared_ptr<spdlog::logger> logger = spdlog::get("rtkcommunication");
+		if (logger == nullptr)
+			logger = spdlog::default_logger();
+
+		logger->info("Session sent {:.2f} MB/s, {:.0f} messages/s, {:.2f} writes per message, latency {:.0f} us average, {:.0f} us max; "
+			"received {:.2f} MB/s, {:.0f} messages/s, {:.2f} reads per message, assembly {:.0f} us average, {:.0f} us max; queued {} messages, {} bytes",
+			(statistics.bytes_sent - logged.bytes_sent) / interval / 1e6,
+			messages_sent / interval,
+			(statistics.write_calls - logged.write_calls) * per_message_sent,
+			(statistics.write_latency_total - logged.write_latency_total) * per_message_sent * 1e6,
+			statistics.write_latency_max * 1e6,
+			(statistics.bytes_received - logged.bytes_received) / interval / 1e6,
+			messages_received / interval,
+			(statistics.read_calls - logged.read_calls) * per_message_received,
+			(statistics.assembly_time_total - logged.assembly_time_total) * per_message_received * 1e6,
+			statistics.assembly_time_max * 1e6,
+			statistics.queue_depth,
+			statistics.queued_bytes);
+
+		_logged_statistics = statistics;
+		LogStatistics();
+	})));
+}
+
+bool Session::IsPeerLocal()
+{
+	boost::system::error_code error;
+
+	boost::asio::ip::address remote_address = _socket->remote_endpoint(error).address();
+	if (error)
+		return false;
+
+	boost::asio::ip::address local_address = _socket->local_endpoint(error).address();
+	if (error)
+		return false;
+
+	return remote_address.is_loopback() || remote_address == local_address;
+}
+
+void Session::HandleSharedMemoryAttached(bool is_peer_attached)
+{
+	if (!_is_connect_pending)
+		return;
+
+	_handshake_timer->cancel();
+
+	// The peer has mapped our ring or never will, the name is not needed any more
+	_shared_memory->Unlink();
+
+	// Everything the peer sent before its answer came over the socket, everything after comes through our inbound ring
+	_is_reading_shared_memory = _shared_memory->IsAttached();
+
+	_is_peer_attached = is_peer_attached;
+	_is_writing_shared_memory = _is_peer_attached && _is_attached_sent;
+
+	if (!_is_reading_shared_memory && !_is_peer_attached)
+		_shared_memory.reset();
+
+	if (_is_reading_shared_memory)
+		WatchSocket();
+
+	_is_connect_pending = false;
+
+	if (OnConnected)
+		OnConnected();
+}
+
+void Session::WatchSocket()
+{
+	boost::asio::async_read(*_socket, boost::asio::buffer(&_watch_byte, 1),
+		_strand->wrap(KeepAlive([this](const boost::system::error_code&, size_t)
+		{
+			// The peer writes nothing to the socket any more, so even data means the connection is broken.
+			// Closing the channel fails the pending read, which reports the error as usual
+			if (_shared_memory != nullptr)
+				_shared_memory->Close();
+		})));
+}
+
+uint16_t Session::Compress(SharedBuffer& msg)
+{
+	// Nothing is compressed for shared memory, copying is cheaper than deflating
+	if (_is_peer_inflating == false || _is_peer_attached == true || msg->size() < SESSION_COMPRESSION_THRESHOLD)
+		return 0;
+
+	std::shared_ptr<std::vector<char>> compressed = std::make_shared<std::vector<char>>();
+
+	// Data that does not shrink (images, files compressed already) is only deflated as far as the sample
+	if (msg->size() > SESSION_COMPRESSION_PROBE_SIZE)
+	{
+		if (Deflate(msg->data(), SESSION_COMPRESSION_PROBE_SIZE, *compressed) == false ||
+			compressed->size() > SESSION_COMPRESSION_PROBE_SIZE - SESSION_COMPRESSION_PROBE_SIZE / SESSION_COMPRESSION_MIN_SAVING)
+			return 0;
+	}
+
+	if (Deflate(msg->data(), msg->size(), *compressed) == false || compressed->size() > msg->size() - msg->size() / SESSION_COMPRESSION_MIN_SAVING)
+		return 0;
+
+	msg = std::move(compressed);
+
+	return MESSAGE_FLAG_COMPRESSED;
+}
+
+bool Session::Deflate(const char* data, size_t size, std::vector<char>& compressed)
+{
+	// Every frame is a complete deflate stream, so the frames do not depend on each other and any thread can compress them
+	thread_local DeflateContext context;
+
+	if (context.is_valid == false || size > UINT_MAX)
+		return false;
+
+	deflateReset(&context.stream);
+
+	// The original size goes first, so the receiver can inflate into a buffer of the exact size. deflateBound() leaves room
+	// for the whole stream, so one call finishes it
+	uint64_t original_size = size;
+	compressed.resize(sizeof(uint64_t) + deflateBound(&context.stream, size));
+	memcpy(compressed.data(), &original_size, sizeof(uint64_t));
+
+	context.stream.next_in = (Bytef*)data;
+	context.stream.avail_in = size;
+	context.stream.next_out = (Bytef*)compressed.data() + sizeof(uint64_t);
+	context.stream.avail_out = compressed.size() - sizeof(uint64_t);
+
+	if (deflate(&context.stream, Z_FINISH) != Z_STREAM_END)
+		return false;
+
+	compressed.resize(compressed.size() - context.stream.avail_out);
+
+	return true;
+}
+
+bool Session::Inflate(const char* data, size_t size, PooledBuffer& output, size_t& output_size)
+{
+	uint64_t original_size;
+	if (size < sizeof(uint64_t))
+		return false;
+
+	memcpy(&original_size, data, sizeof(uint64_t));
+
+	// Checked like the frame size, a small frame can announce a huge original size
+	if (original_size > _max_message_size)
+		return false;
+
+	if (_inflate_stream == nullptr)
+	{
+		_inflate_stream.reset(new z_stream());
+
+		if (inflateInit2(_inflate_stream.get(), -15) != Z_OK)
+		{
+			_inflate_stream.reset();
+			return false;
+		}
+	}
+
+	inflateReset(_inflate_stream.get());
+
+	// One spare byte, so that running out of output space cannot be mistaken for a complete frame
+	output = _read_buffer_pool.Acquire(original_size + 1);
+
+	_inflate_stream->next_in = (Bytef*)data + sizeof(uint64_t);
+	_inflate_stream->avail_in = size - sizeof(uint64_t);
+	_inflate_stream->next_out = (Bytef*)output.data.get();
+	_inflate_stream->avail_out = original_size + 1;
+
+	if (inflate(_inflate_stream.get(), Z_FINISH) != Z_STREAM_END || _inflate_stream->avail_in != 0 || _inflate_stream->avail_out != 1)
+		return false;
+
+	output_size = original_size;
+
+	return true;
+}
+
+void Session::ResetCompression()
+{
+	if (_inflate_stream != nullptr)
+	{
+		inflateEnd(_inflate_stream.get());
+		_inflate_stream.reset();
+	}
+
+	_is_peer_inflating = false;
+}
+
+void Session::FailPendingRequests(std::string error)
+{
+	std::unordered_map<uint32_t, PendingRequest> pending_requests = std::move(_pending_requests);
+	_pending_requests.clear();
+
+	for (auto& request : pending_requests)
+	{
+		if (request.second.OnError)
+			request.second.OnError(error);
+	}
+}
+
+void Session::FailConnection(const boost::system::error_code& error, std::string message)
+{
+	std::cerr << message << std::endl;
+	FailPendingRequests(message);
+
+	if (OnConnectionError != nullptr)
+	{
+		OnConnectionError(error, message);
+	}
+}
+
+void Session::CloseConnection(const boost::system::error_code& error, std::string message)
+{
+	// Nothing more is read from or written to the peer, the operations still pending fail with operation_aborted
+	boost::system::error_code ignored_error;
+	_socket->close(ignored_error);
+
+	if (_shared_memory != nullptr)
+		_shared_memory->Close();
+
+	FailConnection(error, message);
+}
+
+void Session::WriteFolder(Folder& folder)
+{
+	std::vector<uint32_t> file_ids(folder.files.size());
+	for (size_t i = 0; i < file_ids.size(); i++)
+		file_ids[i] = i;
+
+	QueueFolder(folder, file_ids, false, {});
+}
+
+void Session::WriteFolderInterleaved(Folder& folder, const std::vector<FolderChunkHeader>& valid_chunks)
+{
+	std::vector<uint32_t> file_ids(folder.files.size());
+	for (size_t i = 0; i < file_ids.size(); i++)
+		file_ids[i] = i;
+
+	QueueFolder(folder, file_ids, true, valid_chunks);
+}
+
+void Session::WriteFolderInterleaved(Folder& folder, const std::vector<Session*>& sessions, const std::vector<FolderChunkHeader>& valid_chunks)
+{
+	// Largest files first, each to the connection with the fewest bytes so far, so the connections finish at about the same time
+	std::vector<uint32_t> order(folder.files.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+
+	std::stable_sort(order.begin(), order.end(), [&folder](uint32_t a, uint32_t b) { return folder.files[a].size > folder.files[b].size; });
+
+	std::vector<std::vector<uint32_t>> file_ids(sessions.size());
+	std::vector<size_t> assigned_size(sessions.size(), 0);
+
+	for (uint32_t file_id : order)
+	{
+		size_t target = std::min_element(assigned_size.begin(), assigned_size.end()) - assigned_size.begin();
+		file_ids[target].push_back(file_id);
+		assigned_size[target] += folder.files[file_id].size;
+	}
+
+	// Keep the original order within a connection
+	for (size_t i = 0; i < sessions.size(); i++)
+	{
+		std::sort(file_ids[i].begin(), file_ids[i].end());
+		sessions[i]->QueueFolder(folder, file_ids[i], true, valid_chunks);
+	}
+}
+
+void Session::QueueFolder(Folder& folder, const std::vector<uint32_t>& file_ids, bool is_interleaved, const std::vector<FolderChunkHeader>& valid_chunks)
+{
+	std::shared_ptr<FolderTransfer> transfer = std::make_shared<FolderTransfer>();
+	transfer->is_interleaved = is_interleaved;
+	transfer->max_active_files = is_interleaved ? FOLDER_INTERLEAVED_FILES : 1;
+
+	if (is_interleaved)
+		transfer->window.resize(FOLDER_CHUNK_SIZE);
+
+	std::vector<size_t> file_indices(folder.files.size(), SIZE_MAX);
+
+	for (uint32_t file_id : file_ids)
+	{
+		const File& file = folder.files[file_id];
+
+		file_indices[file_id] = transfer->files.size();
+		transfer->files.push_back({ folder.folder_path + "/" + file.file_name, file.size, file_id, -1, 0, {} });
+		transfer->total_size += file.size;
+	}
+
+	// Chunks the receiver already holds are skipped; the receiver only reports chunks on the FOLDER_CHUNK_SIZE grid whose checksum it verified
+	for (const FolderChunkHeader& chunk : valid_chunks)
+	{
+		if (chunk.file_id >= file_indices.size() || file_indices[chunk.file_id] == SIZE_MAX)
+			continue;
+
+		FolderTransfer::FileState& file = transfer->files[file_indices[chunk.file_id]];
+		size_t chunk_index = chunk.offset / FOLDER_CHUNK_SIZE;
+		size_t num_of_chunks = (file.size + FOLDER_CHUNK_SIZE - 1) / FOLDER_CHUNK_SIZE;
+
+		if (chunk.offset % FOLDER_CHUNK_SIZE != 0 || chunk_index >= num_of_chunks)
+			continue;
+
+		file.valid_chunks.resize(num_of_chunks, false);
+		if (!file.valid_chunks[chunk_index])
+		{
+			file.valid_chunks[chunk_index] = true;
+			transfer->total_size -= std::min((size_t)FOLDER_CHUNK_SIZE, file.size - chunk.offset);
+		}
+	}
+
+	_strand->post([this, self = KeepAlive(), transfer, queued_time = std::chrono::steady_clock::now()]()
+	{
+		// Sendfile needs the socket in non-blocking mode to return EAGAIN instead of stalling the io thread
+		boost::system::error_code ignored_error;
+		_socket->native_non_blocking(true, ignored_error);
+
+		_outbound_msgs.push_back({ MessageHeader{}, nullptr, transfer, queued_time });
+
+		{
+			std::lock_guard<std::mutex> lock(_statistics_mutex);
+			_statistics.queue_depth = _outbound_msgs.size();
+		}
+
+		if (!_is_writing)
+			StartWrite();
+	});
+}
+
+void Session::SyncFolder(Folder& folder, ThreadPool& pool)
+{
+	std::shared_ptr<Folder> sync_folder = std::make_shared<Folder>(folder);
+
+	std::vector<std::string> file_paths;
+	for (const File& file : folder.files)
+		file_paths.push_back(folder.folder_path + "/" + file.file_name);
+
+	ComputeFileDigests(file_paths, pool, [this, self = KeepAlive(), sync_folder](std::vector<FileDigest> digests)
+	{
+		// The receiver replies with the files it is missing
+		SendRequest(std::make_shared<const std::vector<char>>((const char*)digests.data(), (const char*)(digests.data() + digests.size())),
+			[this, sync_folder](const char* data, size_t size)
+			{
+				std::vector<uint32_t> file_ids(size / sizeof(uint32_t));
+				memcpy(file_ids.data(), data, file_ids.size() * sizeof(uint32_t));
+
+				file_ids.erase(std::remove_if(file_ids.begin(), file_ids.end(),
+					[&sync_folder](uint32_t file_id) { return file_id >= sync_folder->files.size(); }), file_ids.end());
+
+				QueueFolder(*sync_folder, file_ids, false, {});
+			});
+	});
+}
+
+void Session::ReadFolderSync(Folder& folder, ThreadPool& pool, std::function<void()> callback)
+{
+	std::shared_ptr<Folder> sync_folder = std::make_shared<Folder>(folder);
+
+	ReadMessage([this, sync_folder, &pool, callback](const char* data, size_t size)
+	{
+		uint32_t request_id = GetRequestId();
+
+		// Nothing else is read on this connection until the sync is answered, so a message that can't be answered ends it;
+		// the sender's request fails along with the connection
+		if (request_id == 0)
+		{
+			CloseConnection(boost::system::errc::make_error_code(boost::system::errc::protocol_error), "Folder digests were not sent as a request");
+			return;
+		}
+
+		if (size != sync_folder->files.size() * sizeof(FileDigest))
+		{
+			CloseConnection(boost::system::errc::make_error_code(boost::system::errc::protocol_error), "Folder digests do not match the folder");
+			return;
+		}
+
+		std::vector<FileDigest> remote_digests(sync_folder->files.size());
+		memcpy(remote_digests.data(), data, size);
+
+		std::vector<std::string> file_paths;
+		for (const File& file : sync_folder->files)
+			file_paths.push_back(TEMP_FOLDER + sync_folder->GetFolderName() + "/" + file.file_name);
+
+		std::vector<bool> skip_hash(file_paths.size());
+		for (size_t i = 0; i < file_paths.size(); i++)
+		{
+			// Quick check like rsync: a file of the same size and modification time as the sender's was written by an earlier sync
+			struct stat file_stat;
+			skip_hash[i] = stat(file_paths[i].c_str(), &file_stat) != 0 || (uint64_t)file_stat.st_size != remote_digests[i].size ||
+				(int64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec == remote_digests[i].mtime;
+		}
+
+		// The reference moves on to the strand, so the pool's thread does not end up deleting the session
+		ComputeFileDigests(file_paths, pool, [this, self = KeepAlive(), request_id, sync_folder, remote_digests, skip_hash, file_paths, callback](std::vector<FileDigest> local_digests) mutable
+		{
+			_strand->post([this, self = std::move(self), request_id, sync_folder, remote_digests, skip_hash, file_paths, local_digests, callback]()
+			{
+				std::vector<uint32_t> missing_files;
+
+				for (size_t i = 0; i < sync_folder->files.size(); i++)
+				{
+					bool is_present = local_digests[i].size == remote_digests[i].size &&
+						(skip_hash[i] || (local_digests[i].hash[0] == remote_digests[i].hash[0] && local_digests[i].hash[1] == remote_digests[i].hash[1]));
+
+					if (is_present)
+						sync_folder->files[i].rcvd_size = sync_folder->files[i].size;
+					else
+						missing_files.push_back(i);
+				}
+
+				Respond(request_id, (const char*)missing_files.data(), missing_files.size() * sizeof(uint32_t));
+
+				ReadFolder(*sync_folder, [remote_digests, file_paths, callback]()
+				{
+					// Take over the sender's modification times, so the next sync passes the quick check without hashing
+					for (size_t i = 0; i < file_paths.size(); i++)
+					{
+						struct timespec times[2];
+						times[0].tv_sec = 0;
+						times[0].tv_nsec = UTIME_OMIT;
+						times[1].tv_sec = remote_digests[i].mtime / 1000000000;
+						times[1].tv_nsec = remote_digests[i].mtime % 1000000000;
+
+						utimensat(AT_FDCWD, file_paths[i].c_str(), times, 0);
+					}
+
+					callback();
+				});
+			});
+		}, skip_hash);
+	});
+}
+
+void Session::Stop()
+{
+	_socket->close();
+	CloseReadFile();
+
+	if (_resolver != nullptr)
+		_resolver->cancel();
+
+	// Joins the channel's threads, which may still be copying out of the queued messages
+	if (_shared_memory != nullptr)
+	{
+		_shared_memory->Close();
+		_shared_memory.reset();
+	}
+
+	_is_reading_shared_memory = false;
+	_is_writing_shared_memory = false;
+
+	// Nothing queued for this connection may go out on the next one, and the completions of its operations still pending are ignored
+	_connection_id++;
+	ClearOutboundQueue();
+	FailPendingRequests("Connection stopped");
+
+	if (_statistics_timer != nullptr)
+		_statistics_timer->cancel();
+
+	if (_socket != nullptr)
+		delete _socket;
+	
+	_socket = new boost::asio::ip::tcp::socket(*_io_service);
+}
+
+void Session::Reset()
+{
+	_socket->close();
+	CloseReadFile();
+
+	// The io thread has to be gone before the objects its handlers use are deleted
+	_io_service->stop();
+
+	if (_com_thread != nullptr)
+	{
+		if (_com_thread->joinable())
+			_com_thread->join();
+
+		delete _com_thread;
+		_com_thread = nullptr;
+	}
+
+	_shared_memory.reset();
+	_handshake_timer.reset();
+	_statistics_timer.reset();
+	_resolver.reset();
+	_is_reading_shared_memory = false;
+	_is_writing_shared_memory = false;
+
+	// The handlers of the old io_service never run, so nothing else would reset the queue
+	_connection_id++;
+	ClearOutboundQueue();
+	FailPendingRequests("Connection reset");
+
+	if (_socket != nullptr)
+	{
+		delete _socket;
+		_socket = nullptr;
+	}
+
+	if (_strand != nullptr)
+	{
+		delete _strand;
+		_strand = nullptr;
+	}
+
+	if (_io_service != nullptr)
+	{
+		delete _io_service;
+		_io_service = nullptr;
+	}
+
+	_io_service = new boost::asio::io_service();
+	_socket = new boost::asio::ip::tcp::socket(*_io_service);
+	_strand = new boost::asio::io_service::strand(*_io_service);
+}
+
+
+PooledBuffer BufferPool::Acquire(size_t size)
+{
+	auto best = _free_buffers.end();
+
+	for (auto it = _free_buffers.begin(); it != _free_buffers.end(); it++)
+	{
+		if (it->capacity >= size && (best == _free_buffers.end() || it->capacity < best->capacity))
+			best = it;
+	}
+
+	if (best != _free_buffers.end())
+	{
+		PooledBuffer buffer = std::move(*best);
+		_free_buffers.erase(best);
+		return buffer;
+	}
+
+	PooledBuffer buffer;
+	buffer.capacity = size > 0 ? size : 1;
+	buffer.data.reset(new char[buffer.capacity]);
+
+	return buffer;
+}
+
+void BufferPool::Release(PooledBuffer&& buffer)
+{
+	if (buffer.data == nullptr || buffer.capacity > MAX_POOLED_BUFFER_SIZE)
+		return;
+
+	if (_free_buffers.size() == MAX_POOLED_BUFFERS)
+	{
+		// Keep the larger buffers, they are the expensive ones to allocate
+		auto smallest = std::min_element(_free_buffers.begin(), _free_buffers.end(),
+			[](const PooledBuffer& a, const PooledBuffer& b) { return a.capacity < b.capacity; });
+
+		if (smallest->capacity >= buffer.capacity)
+			return;
+
+		_free_buffers.erase(smallest);
+	}
+
+	_free_buffers.push_back(std::move(buffer));
+}
+
+HandlerMemory::HandlerMemory()
+	: _is_in_use(false)
+{
+}
+
+void* HandlerMemory::Allocate(size_t size)
+{
+	if (_is_in_use == false && size <= sizeof(_storage))
+	{
+		_is_in_use = true;
+		return _storage;
+	}
+
+	return ::operator new(size);
+}
+
+void HandlerMemory::Deallocate(void* pointer)
+{
+	if (pointer == _storage)
+		_is_in_use = false;
+	else
+		::operator delete(pointer);
+}
+
+SessionServer::SessionServer(int num_of_threads)
+	: _work(new boost::asio::io_service::work(_io_service)),
+	_acceptor(_io_service),
+	_num_of_threads(num_of_threads > 0 ? num_of_threads : std::max(1u, std::thread::hardware_concurrency())),
+	_next_session_id(0),
+	_is_stopped(false)
+{
+}
+
+SessionServer::~SessionServer()
+{
+	Stop();
+}
+
+void SessionServer::Listen(std::string ip, std::string port, SessionFactory factory)
+{
+	if (factory != nullptr)
+		_factory = factory;
+	else
+		_factory = [](boost::asio::io_service* io_service, boost::asio::io_service::strand* strand, std::function<void(std::string)> OnConnectionError)
+		{
+			return new Session(io_service, strand, OnConnectionError);
+		};
+
+	boost::asio::ip::tcp::resolver resolver(_io_service);
+	boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve(ip, port, boost::asio::ip::tcp::resolver::passive).begin();
+
+	_acceptor.open(endpoint.protocol());
+	_acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+	_acceptor.bind(endpoint);
+	_acceptor.listen(boost::asio::socket_base::max_listen_connections);
+
+	StartAccept();
+
+	for (int i = 0; i < _num_of_threads; i++)
+		_threads.create_thread(boost::bind(&boost::asio::io_service::run, &_io_service));
+}
+
+void SessionServer::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(_sessions_mutex);
+
+		if (_is_stopped)
+			return;
+
+		_is_stopped = true;
+	}
+
+	boost::system::error_code ignored_error;
+	_acceptor.close(ignored_error);
+
+	_work.reset();
+	_io_service.stop();
+	_threads.join_all();
+
+	std::unordered_map<uint64_t, ServerSession> sessions;
+
+	{
+		std::lock_guard<std::mutex> lock(_sessions_mutex);
+		sessions.swap(_sessions);
+	}
+
+	// A session whose handlers are still queued lives on until the io_service deletes them; with its connection closed
+	// the shared memory channel hands it nothing new in the meantime
+	for (auto& [session_id, server_session] : sessions)
+		server_session.session->Stop();
+}
+
+size_t SessionServer::GetNumberOfSessions()
+{
+	std::lock_guard<std::mutex> lock(_sessions_mutex);
+
+	size_t num_of_sessions = 0;
+	for (const auto& [session_id, server_session] : _sessions)
+	{
+		if (server_session.is_connected)
+			num_of_sessions++;
+	}
+
+	return num_of_sessions;
+}
+
+void SessionServer::StartAccept()
+{
+	// Only the accept chain adds sessions, one at a time
+	uint64_t session_id = _next_session_id++;
+	boost::asio::io_service::strand* strand = new boost::asio::io_service::strand(_io_service);
+
+	// The strand goes with the session, which outlives its entry in '_sessions' until its last handler has run
+	std::shared_ptr<Session> session(_factory(&_io_service, strand, [this, session_id](std::string error) { CloseSession(session_id, error); }),
+		[strand](Session* session)
+		{
+			delete session;
+			delete strand;
+		});
+
+	{
+		std::lock_guard<std::mutex> lock(_sessions_mutex);
+		_sessions[session_id].session = session;
+	}
+
+	_acceptor.async_accept(session->GetSocket(), [this, session_id, session, strand](const boost::system::error_code& error)
+	{
+		HandleAccept(session_id, session, strand, error);
+	});
+}
+
+void SessionServer::HandleAccept(uint64_t session_id, std::shared_ptr<Session> session, boost::asio::io_service::strand* strand, const boost::system::error_code& error)
+{
+	if (error == boost::asio::error::operation_aborted)
+		return;
+
+	if (!error)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_sessions_mutex);
+			_sessions[session_id].is_connected = true;
+		}
+
+		// From here on everything the session does runs on its own strand
+		strand->dispatch(boost::bind(&Session::HandleConnect, session, error));
+	}
+	else
+	{
+		std::cerr << error.message() << std::endl;
+
+		std::lock_guard<std::mutex> lock(_sessions_mutex);
+		_sessions.erase(session_id);
+	}
+
+	StartAccept();
+}
+
+void SessionServer::CloseSession(uint64_t session_id, std::string)
+{
+	std::shared_ptr<Session> session;
+
+	{
+		std::lock_guard<std::mutex> lock(_sessions_mutex);
+
+		auto it = _sessions.find(session_id);
+		if (it == _sessions.end())
+			return;
+
+		session = std::move(it->second.session);
+		_sessions.erase(it);
+	}
+
+	// Called from a handler of the session, which keeps it alive until the aborted operations have run their handlers
+	boost::system::error_code ignored_error;
+	session->GetSocket().close(ignored_error);
+}
+
+SessionPool::SessionPool(SessionFactory factory, size_t num_of_spares)
+	: _work(new boost::asio::io_service::work(_io_service)),
+	_num_of_spares(num_of_spares),
+	_is_stopped(false)
+{
+	if (factory != nullptr)
+		_factory = factory;
+	else
+		_factory = []() { return new Session(); };
+
+	// Only the reconnect timers run here, every session has its own io thread
+	_thread = boost::thread(boost::bind(&boost::asio::io_service::run, &_io_service));
+}
+
+SessionPool::~SessionPool()
+{
+	Stop();
+}
+
+std::future<std::shared_ptr<Session>> SessionPool::Acquire(std::string ip, std::string port)
+{
+	std::shared_ptr<std::promise<std::shared_ptr<Session>>> session = std::make_shared<std::promise<std::shared_ptr<Session>>>();
+	std::future<std::shared_ptr<Session>> result = session->get_future();
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (_is_stopped)
+	{
+		session->set_exception(std::make_exception_ptr(std::runtime_error("Session pool stopped")));
+		return result;
+	}
+
+	Endpoint& endpoint = _endpoints[ip + ":" + port];
+	endpoint.ip = ip;
+	endpoint.port = port;
+
+	auto idle = std::find_if(endpoint.sessions.begin(), endpoint.sessions.end(),
+		[](const PooledSession& pooled_session) { return pooled_session.is_connected && !pooled_session.is_in_use; });
+
+	if (idle != endpoint.sessions.end())
+	{
+		idle->is_in_use = true;
+		session->set_value(idle->session);
+	}
+	else
+	{
+		endpoint.waiting.push_back(session);
+	}
+
+	AddSpares(endpoint);
+
+	return result;
+}
+
+void SessionPool::Release(std::shared_ptr<Session> session)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (_is_stopped)
+		return;
+
+	for (auto& endpoint : _endpoints)
+	{
+		for (PooledSession& pooled_session : endpoint.second.sessions)
+		{
+			if (pooled_session.session == session)
+			{
+				pooled_session.is_in_use = false;
+				HandOver(&pooled_session);
+				return;
+			}
+		}
+	}
+}
+
+void SessionPool::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		if (_is_stopped)
+			return;
+
+		_is_stopped = true;
+
+		for (auto& endpoint : _endpoints)
+		{
+			for (std::shared_ptr<std::promise<std::shared_ptr<Session>>>& session : endpoint.second.waiting)
+				session->set_exception(std::make_exception_ptr(std::runtime_error("Session pool stopped")));
+
+			endpoint.second.waiting.clear();
+		}
+	}
+
+	_work.reset();
+	_io_service.stop();
+	_thread.join();
+
+	// Without the lock, a session's io thread may be waiting for it in a callback, which returns as soon as it sees '_is_stopped'
+	for (auto& endpoint : _endpoints)
+	{
+		for (PooledSession& pooled_session : endpoint.second.sessions)
+		{
+			pooled_session.reconnect_timer.reset();
+			pooled_session.session->Reset();
+		}
+	}
+
+	_endpoints.clear();
+}
+
+size_t SessionPool::GetNumberOfSessions(std::string ip, std::string port)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	auto endpoint = _endpoints.find(ip + ":" + port);
+	if (endpoint == _endpoints.end())
+		return 0;
+
+	return std::count_if(endpoint->second.sessions.begin(), endpoint->second.sessions.end(),
+		[](const PooledSession& pooled_session) { return pooled_session.is_connected; });
+}
+
+void SessionPool::AddSpares(Endpoint& endpoint)
+{
+	// Sessions still connecting count too, they will be ready before a new one would be
+	size_t num_of_available = std::count_if(endpoint.sessions.begin(), endpoint.sessions.end(),
+		[](const PooledSession& pooled_session) { return !pooled_session.is_in_use; });
+
+	for (; num_of_available < endpoint.waiting.size() + _num_of_spares; num_of_available++)
+	{
+		endpoint.sessions.emplace_back();
+
+		PooledSession& pooled_session = endpoint.sessions.back();
+		pooled_session.session.reset(_factory());
+		pooled_session.endpoint = &endpoint;
+		pooled_session.reconnect_timer.reset(new boost::asio::steady_timer(_io_service));
+
+		Connect(&pooled_session);
+	}
+}
+
+void SessionPool::Connect(PooledSession* pooled_session)
+{
+	uint64_t attempt = ++pooled_session->attempt;
+
+	std::function<void()> OnConnected = [this, pooled_session, attempt]() { HandleConnect(pooled_session, attempt); };
+	std::function<void(const boost::system::error_code&, std::string)> OnConnectionError = [this, pooled_session, attempt](const boost::system::error_code& error, std::string)
+	{
+		HandleConnectionError(pooled_session, attempt, error);
+	};
+
+	if (attempt == 1)
+		pooled_session->session->Connect(pooled_session->endpoint->ip, pooled_session->endpoint->port, OnConnected, OnConnectionError);
+	else
+		pooled_session->session->Reconnect(OnConnected, OnConnectionError);
+}
+
+void SessionPool::HandleConnect(PooledSession* pooled_session, uint64_t attempt)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (_is_stopped || attempt != pooled_session->attempt)
+		return;
+
+	pooled_session->is_connected = true;
+	pooled_session->backoff = SESSION_POOL_BACKOFF_MIN;
+
+	HandOver(pooled_session);
 }
 
-boost::asio::ip::tcp::socket& Session::GetSocket()
+void SessionPool::HandleConnectionError(PooledSession* pooled_session, uint64_t attempt, const boost::system::error_code& error)
 {
-	return *_socket;
+	// Aborted operations belong to a connection closed on purpose, there is nothing to reconnect
+	if (error == boost::asio::error::operation_aborted)
+		return;
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (_is_stopped || attempt != pooled_session->attempt)
+		return;
+
+	// Further errors of the same connection are ignored
+	pooled_session->attempt++;
+
+	int delay = 0;
+	if (pooled_session->is_connected)
+	{
+		// A dropped connection is tried again at once, a transient drop should only cost one reconnect
+		pooled_session->is_connected = false;
+	}
+	else
+	{
+		delay = pooled_session->backoff;
+		pooled_session->backoff = std::min(pooled_session->backoff * 2, SESSION_POOL_BACKOFF_MAX);
+	}
+
+	pooled_session->reconnect_timer->expires_after(std::chrono::milliseconds(delay));
+	pooled_session->reconnect_timer->async_wait(boost::bind(&SessionPool::HandleReconnectTimer, this, pooled_session, boost::asio::placeholders::error));
 }
 
-void Session::Start()
+void SessionPool::HandleReconnectTimer(PooledSession* pooled_session, const boost::system::error_code& error)
 {
+	if (error)
+		return;
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (_is_stopped)
+		return;
+
+	Connect(pooled_session);
 }
 
-void Session::Connect(std::string ip, std::string port, std::function<void()> OnConnected, std::function<void(std::string)> OnConnectionError)
+void SessionPool::HandOver(PooledSession* pooled_session)
 {
-	this->OnConnected = OnConnected;
-	this->OnConnectionError = OnConnectionError;
+	Endpoint& endpoint = *pooled_session->endpoint;
 
-	boost::asio::ip::tcp::resolver *resolver = new boost::asio::ip::tcp::resolver(*_io_service);
-	boost::asio::ip::tcp::resolver::query query(ip, port);
-	boost::asio::ip::tcp::resolver::iterator iterator = resolver->resolve(query);
+	if (!pooled_session->is_connected || pooled_session->is_in_use || endpoint.waiting.empty())
+		return;
 
-	boost::asio::async_connect(*_socket, iterator,
-		_strand->wrap(boost::bind(&Session::HandleConnect, this,
-			boost::asio::placeholders::error)));
+	pooled_session->is_in_use = true;
 
-	_com_thread = new boost::thread(boost::bind(&boost::asio::io_service::run, _io_service));
+	endpoint.waiting.front()->set_value(pooled_session->session);
+	endpoint.waiting.pop_front();
 }
 
-void Session::HandleConnect(const boost::system::error_code& error)
+FolderReceiver::FolderReceiver(Folder& folder, std::function<void()> OnComplete)
+	: _manifest_path(TEMP_FOLDER + folder.GetFolderName() + FOLDER_MANIFEST_EXTENSION),
+	_total_size(0),
+	_rcvd_size(0),
+	OnComplete(OnComplete)
 {
-	if (!error)
+	std::set<std::filesystem::path> directories;
+
+	for (const File& file : folder.files)
 	{
-		int yes = 1;
-		setsockopt(_socket->native_handle(), SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(int));
+		_file_paths.push_back(TEMP_FOLDER + folder.GetFolderName() + "/" + file.file_name);
+		_file_sizes.push_back(file.size);
+		_total_size += file.size;
 
-		int idle = 10;
-		setsockopt(_socket->native_handle(), IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(int));
+		// Files marked as received (e.g. found unchanged by a folder sync) are not expected in any chunk
+		bool is_present = file.size > 0 && file.rcvd_size >= file.size;
+		_valid_chunks.emplace_back((file.size + FOLDER_CHUNK_SIZE - 1) / FOLDER_CHUNK_SIZE, is_present);
+		_rcvd_sizes.push_back(is_present ? file.size : 0);
+		_rcvd_size += is_present ? file.size : 0;
 
-		int interval = 10;
-		setsockopt(_socket->native_handle(), IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(int));
+		directories.insert(std::filesystem::path(_file_paths.back()).parent_path());
+	}
 
-		int maxpkt = 1000000;
-		setsockopt(_socket->native_handle(), IPPROTO_TCP, TCP_KEEPCNT, &maxpkt, sizeof(int));
-		
-		if (OnConnected)
+	_fds.resize(_file_paths.size(), -1);
+
+	for (const std::filesystem::path& directory : directories)
+		std::filesystem::create_directories(directory);
+
+	// Empty files never show up in a chunk
+	for (size_t i = 0; i < _file_paths.size(); i++)
+	{
+		if (_file_sizes[i] == 0)
 		{
-			OnConnected();
+			int fd = open(_file_paths[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (fd >= 0)
+				close(fd);
 		}
+	}
+
+	LoadManifest();
 
-		boost::asio::async_read(*_socket, boost::asio::buffer(_read_msg, MAX_IP_PACK_SIZE),
-			boost::asio::transfer_exactly(sizeof(size_t)),
-			_strand->wrap(boost::bind(&Session::HandleRead, this,
-				boost::asio::placeholders::error,
-				boost::asio::placeholders::bytes_transferred,
-				std::function<void(const char*, size_t)>(std::bind(&Session::HandleRequests, this, std::placeholders::_1, std::placeholders::_2)))));
+	_manifest_fd = open(_manifest_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+}
 
+FolderReceiver::~FolderReceiver()
+{
+	for (int fd : _fds)
+	{
+		if (fd >= 0)
+			close(fd);
 	}
-	else
+
+	if (_manifest_fd >= 0)
+		close(_manifest_fd);
+}
+
+void FolderReceiver::LoadManifest()
+{
+	std::ifstream manifest(_manifest_path, std::ios::binary);
+	std::vector<char> data;
+
+	FolderChunkHeader chunk;
+	while (manifest.read((char*)&chunk, sizeof(FolderChunkHeader)))
 	{
-		std::cerr << error.message() << std::endl;
+		if (IsValidChunk(chunk) == false || _valid_chunks[chunk.file_id][chunk.offset / FOLDER_CHUNK_SIZE])
+			continue;
 
-		if (OnConnectionError)
-		{
-			OnConnectionError(error.message());
-		}
+		// The manifest is appended without syncing the data first, so a chunk only counts if the bytes on disk still match its checksum
+		int fd = open(_file_paths[chunk.file_id].c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		data.resize(chunk.length);
+		ssize_t read_size = pread(fd, data.data(), chunk.length, chunk.offset);
+		close(fd);
+
+		if (read_size != (ssize_t)chunk.length || Crc32c(data.data(), chunk.length) != chunk.crc)
+			continue;
+
+		_valid_chunks[chunk.file_id][chunk.offset / FOLDER_CHUNK_SIZE] = true;
+		_rcvd_sizes[chunk.file_id] += chunk.length;
+		_rcvd_size += chunk.length;
+		_verified_chunks.push_back(chunk);
 	}
 }
 
-void Session::HandleRequests(const char* data, size_t size)
+bool FolderReceiver::IsValidChunk(const FolderChunkHeader& header)
 {
-	std::string msg(data, data + size);
+	if (header.file_id >= _file_sizes.size() || header.offset % FOLDER_CHUNK_SIZE != 0 || header.offset >= _file_sizes[header.file_id])
+		return false;
 
-	SPDLOG_LOGGER_DEBUG(spdlog::get("rtkcommunication"), "Session received: {}.", msg);
-
-	boost::asio::async_read(*_socket, boost::asio::buffer(_read_msg, MAX_IP_PACK_SIZE),
-			boost::asio::transfer_exactly(sizeof(size_t)),
-			_strand->wrap(boost::bind(&Session::HandleRead, this,
-				boost::asio::placeholders::error,
-				boost::asio::placeholders::bytes_transferred,
-				std::function<void(const char*, size_t)>(std::bind(&Session::HandleRequests, this, std::placeholders::_1, std::placeholders::_2)))));
+	return header.length == std::min((uint64_t)FOLDER_CHUNK_SIZE, _file_sizes[header.file_id] - header.offset);
 }
 
-void Session::HandleRead(const boost::system::error_code& error, size_t bytes_transferred, std::function<void(const char*, size_t)> callback)
+bool FolderReceiver::WriteChunk(const FolderChunkHeader& header, const char* data)
 {
-	if (!error)
+	if (Crc32c(data, header.length) != header.crc)
 	{
-		if (_read_msgs.size() == 0)
-		{
-			std::memcpy(&_read_msgs_size, _read_msg.data(), sizeof(_read_msgs_size));
-		}
+		// Not recorded, so the chunk is sent again when the transfer is resumed
+		std::cerr << "Checksum mismatch in chunk at " << header.offset << " of " << _file_paths[header.file_id] << std::endl;
+		return true;
+	}
 
-		_read_msgs.push_back(_read_msg);
-		_total_read_size += bytes_transferred;
+	int fd;
 
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
 
-		if (_total_read_size < _read_msgs_size)
-		{
-			size_t read_size = _read_msgs_size - _total_read_size > MAX_IP_PACK_SIZE ? MAX_IP_PACK_SIZE : _read_msgs_size - _total_read_size;
+		if (_valid_chunks[header.file_id][header.offset / FOLDER_CHUNK_SIZE])
+			return true;
 
-			boost::asio::async_read(*_socket, boost::asio::buffer(_read_msg, MAX_IP_PACK_SIZE),
-				boost::asio::transfer_exactly(read_size),
-				_strand->wrap(boost::bind(&Session::HandleRead, this,
-					boost::asio::placeholders::error,
-					boost::asio::placeholders::bytes_transferred,
-					callback)));
-		}
-		else
+		fd = _fds[header.file_id];
+		if (fd < 0)
 		{
-			char* msg = new char[_total_read_size];
+			// Not truncated, a resumed transfer keeps the chunks received before
+			fd = open(_file_paths[header.file_id].c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
 
-			int offset = 0;
-			for (int i = 0; i < _read_msgs.size() - 1; i++)
+			if (fd < 0)
 			{
-				int copy_size = _total_read_size - offset > MAX_IP_PACK_SIZE ? MAX_IP_PACK_SIZE : _total_read_size - offset;
-
-				memcpy(msg + offset, _read_msgs[i + 1].data(), copy_size);
-				offset += copy_size;
+				std::cerr << "Failed to open " << _file_paths[header.file_id] << ": " << strerror(errno) << std::endl;
+				return false;
 			}
 
-			_read_msgs.clear();
+			// Chunks arrive out of order, so reserve the whole file before the first one lands
+			fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, _file_sizes[header.file_id]);
+			_fds[header.file_id] = fd;
+		}
+	}
+
+	// Chunks of one file never overlap, so connections write them in parallel without holding the lock
+	size_t written_size = 0;
+	while (written_size < header.length)
+	{
+		ssize_t result = pwrite(fd, data + written_size, header.length - written_size, header.offset + written_size);
+
+		if (result < 0 && errno == EINTR)
+			continue;
 
-			callback(msg, _total_read_size - sizeof(_read_msgs_size));
-			_total_read_size = 0;
-			delete[] msg;
+		if (result < 0)
+		{
+			std::cerr << "Failed to write " << _file_paths[header.file_id] << ": " << strerror(errno) << std::endl;
+			return false;
 		}
+
+		written_size += result;
 	}
-	else
+
+	bool is_complete;
+
 	{
-		std::cerr << error.message() << std::endl;
-		if (OnConnectionError != nullptr)
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		_valid_chunks[header.file_id][header.offset / FOLDER_CHUNK_SIZE] = true;
+		_verified_chunks.push_back(header);
+
+		if (_manifest_fd >= 0 && write(_manifest_fd, &header, sizeof(FolderChunkHeader)) != sizeof(FolderChunkHeader))
+			std::cerr << "Failed to update " << _manifest_path << std::endl;
+
+		_rcvd_sizes[header.file_id] += header.length;
+		if (_rcvd_sizes[header.file_id] == _file_sizes[header.file_id])
+		{
+			// Drop whatever a previous, larger file of the same name left behind
+			if (ftruncate(_fds[header.file_id], _file_sizes[header.file_id]) != 0)
+				std::cerr << "Failed to truncate " << _file_paths[header.file_id] << std::endl;
+
+			close(_fds[header.file_id]);
+			_fds[header.file_id] = -1;
+		}
+
+		_rcvd_size += header.length;
+		is_complete = _rcvd_size == _total_size;
+
+		if (is_complete && _manifest_fd >= 0)
 		{
-			OnConnectionError(error.message());
+			close(_manifest_fd);
+			_manifest_fd = -1;
+			unlink(_manifest_path.c_str());
 		}
 	}
+
+	if (is_complete && OnComplete)
+		OnComplete();
+
+	return true;
 }
 
-void Session::HandleReadFolder(const boost::system::error_code& error, size_t bytes_transferred, Folder& folder, std::function<void()> callback)
+std::vector<FolderChunkHeader> FolderReceiver::GetValidChunks()
 {
-	if (!error)
-	{
-		if (folder.rcvd_files < folder.files.size())
-		{
-			File& file = folder.files[folder.rcvd_files];
-			if (file.rcvd_size < file.size)
-			{
-				std::string filepath = TEMP_FOLDER + folder.GetFolderName() + "/" + file.file_name;
-				std::filesystem::create_directories(std::filesystem::path(filepath).parent_path());
+	std::lock_guard<std::mutex> lock(_mutex);
 
-				std::ofstream output_file(filepath, std::ios::binary | std::ios::app);
+	return _verified_chunks;
+}
 
-				if (file.size - file.rcvd_size < MAX_IP_PACK_SIZE)
-				{
-					output_file.write(_read_msg.data(), file.size - file.rcvd_size);
-					_read_msgs_size += file.size - file.rcvd_size;
-					file.rcvd_size += file.size - file.rcvd_size;
+bool FolderReceiver::IsComplete()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
 
-					if (OnReceiveUpdate)
-						OnReceiveUpdate((float)_read_msgs_size / (float)folder.GetTotalSize() * 100);
+	return _rcvd_size == _total_size;
+}
 
-					folder.rcvd_files++;
+float FolderReceiver::GetProgress()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
 
-					if (folder.rcvd_files == folder.files.size())
-					{
-						callback();
-						return;
-					}
-				}
-				else
-				{
-					output_file.write(_read_msg.data(), bytes_transferred);
-					file.rcvd_size += bytes_transferred;
-					_read_msgs_size += bytes_transferred;
+	return _total_size > 0 ? (float)_rcvd_size / (float)_total_size * 100 : 100;
+}
 
-					if (OnReceiveUpdate)
-						OnReceiveUpdate((float)_read_msgs_size / (float)folder.GetTotalSize() * 100);
-				}
+struct rtkcommunication::SharedMemoryRing
+{
+	uint64_t magic;
+	uint64_t token;
 
-				output_file.close();
-			}
-			else
-			{
-				folder.rcvd_files++;
-			}
+	// Positions count every byte ever written or read, the offset into 'data' is the position modulo SHARED_MEMORY_RING_SIZE.
+	// Each sequence is bumped whenever its position moves, so a waiting side can sleep on it with FUTEX_WAIT
+	alignas(64) std::atomic<uint64_t> write_position;
+	std::atomic<uint32_t> write_sequence;
+	std::atomic<uint32_t> is_reader_waiting;
 
-			boost::asio::async_read(*_socket, boost::asio::buffer(_read_msg, MAX_IP_PACK_SIZE),
-				boost::asio::transfer_all(),
-				_strand->wrap(boost::bind(&Session::HandleReadFolder, this,
-					boost::asio::placeholders::error,
-					boost::asio::placeholders::bytes_transferred,
-					folder,
-					callback)));
-		}
-		else 
-		{
-			callback();
-		}
+	alignas(64) std::atomic<uint64_t> read_position;
+	std::atomic<uint32_t> read_sequence;
+	std::atomic<uint32_t> is_writer_waiting;
+
+	alignas(64) std::atomic<uint32_t> is_closed;
+
+	alignas(64) char data[SHARED_MEMORY_RING_SIZE];
+};
+
+namespace
+{
+	const uint64_t SHARED_MEMORY_MAGIC = 0x474E495253544B52;  // "RKTSRING"
+
+	std::atomic<uint32_t> shared_memory_counter(0);
+
+	void FutexWait(std::atomic<uint32_t>& word, uint32_t value)
+	{
+		// Not FUTEX_PRIVATE_FLAG, the other side of the ring is another process
+		syscall(SYS_futex, (uint32_t*)&word, FUTEX_WAIT, value, nullptr, nullptr, 0);
 	}
-	else
+
+	void FutexWake(std::atomic<uint32_t>& word)
 	{
-		std::cerr << error.message() << std::endl;
-	}	
-}
+		syscall(SYS_futex, (uint32_t*)&word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+	}
 
-void Session::HandleWrite(const boost::system::error_code& error, size_t bytes_transferred)
-{
-	if (!error)
+	/**
+	 * @brief Wait until 'is_ready' holds, first spinning, then sleeping on 'sequence'. Returns false if the ring is closed first.
+	 */
+	template <typename Predicate>
+	bool WaitForRing(SharedMemoryRing& ring, std::atomic<uint32_t>& sequence, std::atomic<uint32_t>& is_waiting, Predicate is_ready)
 	{
-		_write_msgs.pop_front();
-		_write_msgs_size -= bytes_transferred;
+		// On a single hardware thread spinning only keeps the other side from running
+		static const int spin_count = std::thread::hardware_concurrency() > 1 ? SHARED_MEMORY_SPIN_COUNT : 0;
 
-		if (!_write_msgs.empty())
+		for (int i = 0; i < spin_count; i++)
 		{
-			size_t msg_size = _write_msgs_size > MAX_IP_PACK_SIZE ? MAX_IP_PACK_SIZE : _write_msgs_size;
+			if (is_ready())
+				return true;
+
+			if (ring.is_closed.load())
+				return false;
 
-			boost::asio::async_write(*_socket, boost::asio::buffer(_write_msgs.front().data(), msg_size),
-				boost::asio::transfer_exactly(msg_size),
-				_strand->wrap(boost::bind(&Session::HandleWrite, this,
-					boost::asio::placeholders::error,
-					boost::asio::placeholders::bytes_transferred)));
+#if defined(__x86_64__) || defined(__i386__)
+			_mm_pause();
+#endif
 		}
-		else
+
+		while (true)
 		{
-			_total_write_size = 0;
-			_mutex_write.unlock();
+			// The other side moves its position before it reads 'is_waiting', we set 'is_waiting' before we check the position,
+			// so either we see the new position or it sees us waiting and wakes us
+			uint32_t value = sequence.load();
+			is_waiting.store(1);
+
+			if (is_ready())
+			{
+				is_waiting.store(0);
+				return true;
+			}
+
+			if (ring.is_closed.load())
+			{
+				is_waiting.store(0);
+				return false;
+			}
+
+			FutexWait(sequence, value);
+			is_waiting.store(0);
 		}
 	}
-	else
+
+	/**
+	 * @brief Copy up to 'size' bytes out of the ring, waiting until there is at least one. Returns 0 once the ring is closed and empty.
+	 */
+	size_t ReadRing(SharedMemoryRing& ring, char* data, size_t size)
 	{
-		std::cerr << error.message() << std::endl;
+		uint64_t read_position = ring.read_position.load(std::memory_order_relaxed);
 
-		if (OnConnectionError != nullptr)
+		if (WaitForRing(ring, ring.write_sequence, ring.is_reader_waiting, [&ring, read_position]() { return ring.write_position.load() != read_position; }) == false)
 		{
-			OnConnectionError(error.message());
+			// Whatever was written before closing is still delivered
+			if (ring.write_position.load() == read_position)
+				return 0;
 		}
+
+		size_t available = ring.write_position.load() - read_position;
+		size = std::min(size, available);
+
+		size_t offset = read_position & (SHARED_MEMORY_RING_SIZE - 1);
+		size_t first_size = std::min(size, (size_t)SHARED_MEMORY_RING_SIZE - offset);
+		memcpy(data, ring.data + offset, first_size);
+		memcpy(data + first_size, ring.data, size - first_size);
+
+		ring.read_position.store(read_position + size);
+		ring.read_sequence.fetch_add(1);
+
+		if (ring.is_writer_waiting.load())
+			FutexWake(ring.read_sequence);
+
+		return size;
 	}
-}
 
-void Session::HandleWriteFolder(const boost::system::error_code& error, size_t bytes_transferred)
-{
-	if (!error)
+	/**
+	 * @brief Copy up to 'size' bytes into the ring, waiting until there is room for at least one. Returns 0 if the ring is closed.
+	 */
+	size_t WriteRing(SharedMemoryRing& ring, const char* data, size_t size)
 	{
-		_write_msgs.pop_front();
-		_write_msgs_size -= bytes_transferred;
+		uint64_t write_position = ring.write_position.load(std::memory_order_relaxed);
 
-		if (OnSendUpdate)
-			OnSendUpdate((1 - (float)_write_msgs_size / (float)_total_write_size) * 100);
+		if (WaitForRing(ring, ring.read_sequence, ring.is_writer_waiting, [&ring, write_position]() { return write_position - ring.read_position.load() < SHARED_MEMORY_RING_SIZE; }) == false)
+			return 0;
 
-		if (!_write_msgs.empty())
-		{
-			size_t msg_size = _write_msgs_size > MAX_IP_PACK_SIZE ? MAX_IP_PACK_SIZE : _write_msgs_size;
+		size_t free_size = SHARED_MEMORY_RING_SIZE - (write_position - ring.read_position.load());
+		size = std::min(size, free_size);
 
-			boost::asio::async_write(*_socket, boost::asio::buffer(_write_msgs.front().data(), msg_size),
-				boost::asio::transfer_exactly(msg_size),
-				_strand->wrap(boost::bind(&Session::HandleWriteFolder, this,
-					boost::asio::placeholders::error,
-					boost::asio::placeholders::bytes_transferred)));
-		}
-		else
-		{
-			if (OnSendComplete)
-			{
-				OnSendComplete();
-				OnSendComplete = nullptr;
-			}
-			OnSendUpdate = nullptr;
-			_total_write_size = 0;
-		}
+		size_t offset = write_position & (SHARED_MEMORY_RING_SIZE - 1);
+		size_t first_size = std::min(size, (size_t)SHARED_MEMORY_RING_SIZE - offset);
+		memcpy(ring.data + offset, data, first_size);
+		memcpy(ring.data, data + first_size, size - first_size);
+
+		ring.write_position.store(write_position + size);
+		ring.write_sequence.fetch_add(1);
+
+		if (ring.is_reader_waiting.load())
+			FutexWake(ring.write_sequence);
+
+		return size;
 	}
-	else
+
+	void CloseRing(SharedMemoryRing* ring)
 	{
-		std::cerr << error.message() << std::endl;
+		if (ring == nullptr)
+			return;
+
+		ring->is_closed.store(1);
+		ring->write_sequence.fetch_add(1);
+		ring->read_sequence.fetch_add(1);
+
+		FutexWake(ring->write_sequence);
+		FutexWake(ring->read_sequence);
 	}
 }
 
-void Session::Write(const char* msg, size_t size)
+SharedMemoryChannel::SharedMemoryChannel()
+	: _outbound(nullptr),
+	_inbound(nullptr),
+	_token(0),
+	_is_linked(false),
+	_read_work(_read_service),
+	_write_work(_write_service)
+{
+}
+
+SharedMemoryChannel::~SharedMemoryChannel()
+{
+	Close();
+
+	_read_service.stop();
+	_write_service.stop();
+
+	if (_read_thread != nullptr)
+		_read_thread->join();
+
+	if (_write_thread != nullptr)
+		_write_thread->join();
+
+	Unlink();
+
+	if (_outbound != nullptr)
+		munmap(_outbound, sizeof(SharedMemoryRing));
+
+	if (_inbound != nullptr)
+		munmap(_inbound, sizeof(SharedMemoryRing));
+}
+
+bool SharedMemoryChannel::Create()
 {
-	_mutex_write.lock();
-	_write_msgs_size = size + sizeof(size);
-	_total_write_size = size + sizeof(size);
+	std::random_device random_device;
+	_token = ((uint64_t)random_device() << 32) | random_device();
+	_name = "/rtkcommunication_" + std::to_string(getpid()) + "_" + std::to_string(shared_memory_counter++);
+
+	int fd = shm_open(_name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return false;
 
-	std::array<char, MAX_IP_PACK_SIZE> write_msg;
-	char* _total_size = static_cast<char*>(static_cast<void*>(&_total_write_size));
-	std::copy(_total_size, _total_size + sizeof(_total_write_size), write_msg.begin());
-	_write_msgs.push_back(write_msg);
+	_is_linked = true;
 
-	for (size_t i = 0; i < size; i += MAX_IP_PACK_SIZE)
+	if (ftruncate(fd, sizeof(SharedMemoryRing)) != 0)
 	{
-		std::array<char, MAX_IP_PACK_SIZE> write_msg;
-		size_t msg_size = (size - i) > MAX_IP_PACK_SIZE ? MAX_IP_PACK_SIZE : size - i;
+		close(fd);
+		return false;
+	}
+
+	void* memory = mmap(nullptr, sizeof(SharedMemoryRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (memory == MAP_FAILED)
+		return false;
+
+	// The new object is zero filled, which is what the positions and flags start from
+	_outbound = new (memory) SharedMemoryRing;
+	_outbound->token = _token;
+	_outbound->magic = SHARED_MEMORY_MAGIC;
+
+	return true;
+}
+
+bool SharedMemoryChannel::Attach(const std::string& name, uint64_t token)
+{
+	// Only names made by Create(), anything else is not ours to open
+	if (name.rfind("/rtkcommunication_", 0) != 0 || name.find('/', 1) != std::string::npos)
+		return false;
 
-		std::copy(msg + i, msg + i + msg_size, write_msg.begin());
+	int fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
 
-		_write_msgs.push_back(write_msg);
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || (size_t)file_stat.st_size != sizeof(SharedMemoryRing))
+	{
+		close(fd);
+		return false;
 	}
 
-	if (_write_msgs.size() > 0)
+	void* memory = mmap(nullptr, sizeof(SharedMemoryRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (memory == MAP_FAILED)
+		return false;
+
+	// A peer in another IPC namespace may have a different object of the same name
+	SharedMemoryRing* ring = (SharedMemoryRing*)memory;
+	if (ring->magic != SHARED_MEMORY_MAGIC || ring->token != token)
 	{
-		size_t msg_size = sizeof(size);
+		munmap(memory, sizeof(SharedMemoryRing));
+		return false;
+	}
 
-		boost::asio::async_write(*_socket, boost::asio::buffer(_write_msgs.front().data(), msg_size),
-			boost::asio::transfer_exactly(msg_size),
-			_strand->wrap(boost::bind(&Session::HandleWrite, this,
-				boost::asio::placeholders::error,
-				boost::asio::placeholders::bytes_transferred)));
+	_inbound = ring;
+
+	return true;
+}
+
+void SharedMemoryChannel::Unlink()
+{
+	if (_is_linked)
+	{
+		shm_unlink(_name.c_str());
+		_is_linked = false;
 	}
 }
 
-void Session::WriteFolder(Folder& folder)
+const std::string& SharedMemoryChannel::GetName() const
 {
-	_write_msgs_size = 0;
+	return _name;
+}
 
-	for (File fileDescr : folder.files)
-	{
-		// Make full file path
-		std::string filepath = folder.folder_path + "/";
-		filepath += fileDescr.file_name;
+uint64_t SharedMemoryChannel::GetToken() const
+{
+	return _token;
+}
+
+bool SharedMemoryChannel::IsAttached() const
+{
+	return _inbound != nullptr;
+}
 
-		std::ifstream file;
-		file.open(filepath, std::ios::in | std::ios::binary | std::ios::ate);
+void SharedMemoryChannel::AsyncRead(std::vector<boost::asio::mutable_buffer> buffers, Handler handler)
+{
+	if (_read_thread == nullptr)
+		_read_thread.reset(new boost::thread(boost::bind(&boost::asio::io_service::run, &_read_service)));
 
-		if (file.is_open())
-		{
-			size_t size = fileDescr.size;
+	_read_service.post([this, buffers = std::move(buffers), handler]()
+	{
+		size_t bytes_transferred = 0;
 
-			for (size_t i = 0; i <= size; i += MAX_IP_PACK_SIZE) // Send empty message at the end if size % MAX_IP_PACK_SIZE == 0
+		for (const boost::asio::mutable_buffer& buffer : buffers)
+		{
+			for (size_t read_size = 0; read_size < buffer.size(); )
 			{
-				std::array<char, MAX_IP_PACK_SIZE> write_msg;
-				size_t msg_size = (size - i) > MAX_IP_PACK_SIZE ? MAX_IP_PACK_SIZE : size - i;
-				file.seekg(i, std::ios::beg);
-				file.read(write_msg.data(), msg_size);
-				_write_msgs_size += MAX_IP_PACK_SIZE;
-				_write_msgs.push_back(write_msg);
+				size_t result = ReadRing(*_inbound, (char*)buffer.data() + read_size, buffer.size() - read_size);
+
+				if (result == 0)
+				{
+					handler(boost::asio::error::eof, bytes_transferred + read_size);
+					return;
+				}
+
+				read_size += result;
 			}
 
-			file.close();
-		}
-		else
-		{
-			std::cerr << "File not found" << std::endl;
+			bytes_transferred += buffer.size();
 		}
-	}
-	
-	if (_write_msgs.size() > 0)
-	{
-		_total_write_size = _write_msgs_size;
-		boost::asio::async_write(*_socket, boost::asio::buffer(_write_msgs.front().data(), MAX_IP_PACK_SIZE),
-			boost::asio::transfer_exactly(MAX_IP_PACK_SIZE),
-			_strand->wrap(boost::bind(&Session::HandleWriteFolder, this,
-				boost::asio::placeholders::error,
-				boost::asio::placeholders::bytes_transferred)));
-	}
+
+		handler(boost::system::error_code(), bytes_transferred);
+	});
 }
 
-void Session::Stop()
+void SharedMemoryChannel::AsyncWrite(std::vector<boost::asio::const_buffer> buffers, Handler handler)
 {
-	_socket->close();
+	if (_write_thread == nullptr)
+		_write_thread.reset(new boost::thread(boost::bind(&boost::asio::io_service::run, &_write_service)));
 
-	if (_socket != nullptr)
-		delete _socket;
-	
-	_socket = new boost::asio::ip::tcp::socket(*_io_service);
+	_write_service.post([this, buffers = std::move(buffers), handler]()
+	{
+		size_t bytes_transferred = 0;
+
+		for (const boost::asio::const_buffer& buffer : buffers)
+		{
+			for (size_t written_size = 0; written_size < buffer.size(); )
+			{
+				size_t result = WriteRing(*_outbound, (const char*)buffer.data() + written_size, buffer.size() - written_size);
+
+				if (result == 0)
+				{
+					handler(boost::asio::error::broken_pipe, bytes_transferred + written_size);
+					return;
+				}
+
+				written_size += result;
+			}
+
+			bytes_transferred += buffer.size();
+		}
+
+		handler(boost::system::error_code(), bytes_transferred);
+	});
 }
 
-void Session::Reset()
+bool SharedMemoryChannel::TryWrite(const std::vector<boost::asio::const_buffer>& buffers)
 {
-	_socket->close();
+	size_t size = boost::asio::buffer_size(buffers);
 
-	if (_socket != nullptr)
-    {
-		delete _socket;
-        _socket = nullptr;
-    }
-
-    if (_strand != nullptr)
-    {
-        delete _strand;
-        _strand = nullptr;
-    }
-
-    _io_service->stop();
-    if (_io_service != nullptr)
-    {
-		delete _io_service;
-        _io_service = nullptr;
-    }
-    
-    while (true)
-    {
-        if (_com_thread->joinable())
-        {
-            _com_thread->join();
-            delete _com_thread;
-            break;
-        }
-    }
-
-    _io_service = new boost::asio::io_service();
-	_socket = new boost::asio::ip::tcp::socket(*_io_service);
-	_strand = new boost::asio::io_service::strand(*_io_service);
+	if (_outbound->is_closed.load() || size > SHARED_MEMORY_RING_SIZE - (_outbound->write_position.load() - _outbound->read_position.load()))
+		return false;
+
+	// There is room for everything, so none of these waits
+	for (const boost::asio::const_buffer& buffer : buffers)
+	{
+		for (size_t written_size = 0; written_size < buffer.size(); )
+			written_size += WriteRing(*_outbound, (const char*)buffer.data() + written_size, buffer.size() - written_size);
+	}
+
+	return true;
 }
+
+void SharedMemoryChannel::Close()
+{
+	CloseRing(_outbound);
+	CloseRing(_inbound);
+}
\ No newline at end of file
@@ -1,78 +1,1098 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <list>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "rtkcommunication/Common/Data/Folder.h"
 #include "rtkcommunication/Common/Data/Request.h"
 #include "rtkcommunication/Common/JsonObject.h"
+#include "rtkcommunication/Common/ThreadPool.h"
+
+#include <zlib.h>
 
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
 #include <boost/thread/thread.hpp>
 
 #define MAX_IP_PACK_SIZE 300000
+#define MAX_COALESCED_MESSAGES 32  // Two buffers per message, asio gathers at most 64 buffers into one writev
+#define MAX_COALESCED_BYTES 262144
+#define MAX_POOLED_BUFFERS 8
+#define MAX_POOLED_BUFFER_SIZE 16777216  // Larger receive buffers are freed after use instead of being kept
+#define SESSION_MAX_MESSAGE_SIZE 1073741824  // Default largest message accepted from the peer, see Session::SetMaxMessageSize()
+#define HANDLER_MEMORY_SIZE 1024  // Bytes a session keeps for the operation state of its outstanding read, and as much for its write
+#define FOLDER_SEND_WINDOW 1048576  // Bytes handed to the socket per sendfile call
+#define FOLDER_CHUNK_SIZE 262144  // Largest chunk of an interleaved folder transfer, must not exceed MAX_IP_PACK_SIZE
+#define FOLDER_INTERLEAVED_FILES 8  // Files sent side by side on one connection in an interleaved folder transfer
+#define FOLDER_END_OF_STREAM 0xFFFFFFFF  // File id of the chunk header closing an interleaved folder stream
+#define FILE_HASH_BLOCK_SIZE 1048576  // Bytes read at a time when hashing a file for a folder sync, must be a multiple of 16
+#define FOLDER_MANIFEST_EXTENSION ".manifest"  // Chunks received so far are recorded in TEMP_FOLDER/<folder name>.manifest until the folder is complete
+#define SESSION_COMPRESSION_THRESHOLD 1024  // Smaller payloads are sent uncompressed, they gain little and would only pay the latency
+#define SESSION_COMPRESSION_LEVEL 6
+#define SESSION_COMPRESSION_MIN_SAVING 8  // A compressed payload is only sent if it is at least 1/8 smaller than the original
+#define SESSION_COMPRESSION_PROBE_SIZE 4096  // Larger payloads are only compressed if a sample of this size from their start shrinks
+#define SESSION_CAPABILITY_DEFLATE 0x1  // Capability bit of the Hello message: the peer inflates frames flagged MESSAGE_FLAG_COMPRESSED
+#define MESSAGE_FLAG_COMPRESSED 0x1  // The payload is the original size (uint64_t) followed by a complete raw deflate stream, independent of other frames
+#define SESSION_CAPABILITY_SHARED_MEMORY 0x2  // Capability bit of the Hello message: a uint64_t token and the name of the sender's outbound ring follow the bit mask
+#define SHARED_MEMORY_RING_SIZE 8388608  // Bytes of the ring buffer of each direction, must be a power of two
+#define SHARED_MEMORY_SPIN_COUNT 4096  // Polls of an empty or full ring before sleeping on its futex
+#define SHARED_MEMORY_HANDSHAKE_TIMEOUT 500  // Milliseconds to wait for the peer's answer to a shared memory offer before staying on TCP
+#define SESSION_STATISTICS_LOG_INTERVAL 10000  // Default milliseconds between two statistics log lines of a session
+#define SESSION_POOL_SPARES 1  // Connected sessions a SessionPool keeps idle per endpoint, so that acquiring one does not wait for a connection
+#define SESSION_POOL_BACKOFF_MIN 100  // Milliseconds before a pooled session retries a failed reconnect, doubled after every further failure
+#define SESSION_POOL_BACKOFF_MAX 10000  // Longest interval between two reconnect attempts of a pooled session
 #define TEMP_FOLDER "temp/"  // WARNING: This folder will be deleted if it exists when the program starts
 
 
 namespace rtkcommunication
 
 {
-	class Session
+	enum class MessageType : uint16_t
+	{
+		Message,  // Plain message passed to Session::HandleRequests()
+		Request,  // Message expecting a response with the same stream id
+		Response,  // Answer to the request with the same stream id
+		Hello,  // Capabilities (uint32_t bit mask) sent right after connecting, consumed by the session
+		SharedMemoryAttached  // Answer to a Hello offering shared memory (uint32_t, 1 if the ring was mapped), consumed by the session
+	};
+
+
+	/**
+	 * @brief Frame header of every message. 'length' is the total size including the header, 'stream_id' pairs a response with its request
+	 * (0 for plain messages), 'type' is a MessageType.
+	 */
+	struct MessageHeader
+	{
+		uint64_t length;
+		uint32_t stream_id;
+		uint16_t type;
+		uint16_t flags;
+	};
+
+
+	/**
+	 * @brief Transport counters of one Session since it connected, see Session::GetStatistics(). Averages are the totals divided by the message counts.
+	 */
+	struct SessionStatistics
+	{
+		uint64_t bytes_sent = 0;  // Including message headers and folder data
+		uint64_t bytes_received = 0;
+		uint64_t messages_sent = 0;  // A folder counts as one message
+		uint64_t messages_received = 0;
+		uint64_t write_calls = 0;  // Writes to the socket or the shared memory channel, fewer than messages if coalescing works
+		uint64_t read_calls = 0;
+		size_t queue_depth = 0;  // Messages queued or being written
+		size_t queued_bytes = 0;
+		double write_latency_total = 0;  // Seconds from Write() until the last byte of the message is written, summed over all messages sent
+		double write_latency_max = 0;
+		double assembly_time_total = 0;  // Seconds from the header of a message arriving until its payload is complete, summed over all messages received
+		double assembly_time_max = 0;
+		double elapsed = 0;  // Seconds since the session connected
+	};
+
+
+	/**
+	 * @brief Receive buffer whose memory is left uninitialized, so that allocating it for a large message does not touch every page twice.
+	 */
+	struct PooledBuffer
+	{
+		std::unique_ptr<char[]> data;
+		size_t capacity = 0;
+	};
+
+
+	/**
+	 * @brief Recycles receive buffers between messages, so that a steady stream of messages does not allocate. Not thread safe,
+	 * a session only uses it from its strand.
+	 */
+	class BufferPool
+	{
+
+	public:
+		/**
+		 * @brief Get a buffer of at least 'size' bytes, reusing the smallest free buffer that fits.
+		 */
+		PooledBuffer Acquire(size_t size);
+		void Release(PooledBuffer&& buffer);
+
+	private:
+		std::vector<PooledBuffer> _free_buffers;
+	};
+
+
+	/**
+	 * @brief Memory for the state of one outstanding asynchronous operation, reused by the next one. A session starts its next read or write
+	 * only from the handler of the previous one, so one block per direction is enough. Larger requests, or requests while the block is in use,
+	 * go to the heap. Shared by the handlers allocated from it, since the io_service may destroy an aborted operation after its session.
+	 */
+	class HandlerMemory
 	{
 
 	public:
+		HandlerMemory();
+
+		void* Allocate(size_t size);
+		void Deallocate(void* pointer);
+
+	private:
+		HandlerMemory(const HandlerMemory&) = delete;
+		HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+		alignas(std::max_align_t) unsigned char _storage[HANDLER_MEMORY_SIZE];
+		bool _is_in_use;
+	};
+
+
+	/**
+	 * @brief Allocator handing out a HandlerMemory, found by asio through the allocator_type of AllocatedHandler.
+	 */
+	template <typename T>
+	class HandlerAllocator
+	{
+
+	public:
+		typedef T value_type;
+
+		explicit HandlerAllocator(const std::shared_ptr<HandlerMemory>& memory)
+			: _memory(memory)
+		{
+		}
+
+		template <typename U>
+		HandlerAllocator(const HandlerAllocator<U>& other)
+			: _memory(other._memory)
+		{
+		}
+
+		T* allocate(size_t n)
+		{
+			return static_cast<T*>(_memory->Allocate(sizeof(T) * n));
+		}
+
+		void deallocate(T* pointer, size_t)
+		{
+			_memory->Deallocate(pointer);
+		}
+
+		bool operator==(const HandlerAllocator& other) const
+		{
+			return _memory == other._memory;
+		}
+
+		bool operator!=(const HandlerAllocator& other) const
+		{
+			return _memory != other._memory;
+		}
+
+	private:
+		template <typename> friend class HandlerAllocator;
+
+		std::shared_ptr<HandlerMemory> _memory;
+	};
+
+
+	/**
+	 * @brief Completion handler whose operation state asio allocates from 'memory' instead of the heap.
+	 */
+	template <typename Handler>
+	class AllocatedHandler
+	{
+
+	public:
+		typedef HandlerAllocator<Handler> allocator_type;
+
+		AllocatedHandler(const std::shared_ptr<HandlerMemory>& memory, Handler handler)
+			: _memory(memory),
+			_handler(std::move(handler))
+		{
+		}
+
+		allocator_type get_allocator() const noexcept
+		{
+			return allocator_type(_memory);
+		}
+
+		template <typename... Args>
+		void operator()(Args&&... args)
+		{
+			_handler(std::forward<Args>(args)...);
+		}
+
+	private:
+		std::shared_ptr<HandlerMemory> _memory;
+		Handler _handler;
+	};
+
+
+	/**
+	 * @brief CRC32C (Castagnoli) of 'size' bytes, continuing from 'crc'. Uses the SSE4.2 crc32 instruction if the CPU has it, a lookup table otherwise.
+	 */
+	uint32_t Crc32c(const char* data, size_t size, uint32_t crc = 0);
+
+
+	/**
+	 * @brief Frame preceding every chunk of an interleaved folder transfer. 'file_id' is the index of the file in Folder::files.
+	 * Chunks start at multiples of FOLDER_CHUNK_SIZE within their file, 'crc' is the CRC32C of the chunk data.
+	 */
+	struct FolderChunkHeader
+	{
+		uint32_t file_id;
+		uint32_t length;
+		uint64_t offset;
+		uint32_t crc;
+		uint32_t reserved;
+	};
+
+
+	/**
+	 * @brief Identity of a file exchanged by a folder sync. 'hash' is the MurmurHash3 x64 128-bit of the contents, 'mtime' is in nanoseconds.
+	 */
+	struct FileDigest
+	{
+		uint64_t size;
+		int64_t mtime;
+		uint64_t hash[2];
+	};
+
+
+	/**
+	 * @brief Reassembles an interleaved folder transfer into TEMP_FOLDER. Chunks may arrive in any order and over several sessions at once,
+	 * each of which calls Session::ReadFolderInterleaved() with the same receiver. Chunks failing their checksum are dropped.
+	 *
+	 * Every verified chunk is recorded in a manifest next to the folder. A receiver created for a folder with a manifest picks up where the
+	 * previous one stopped: send GetValidChunks() to the sender, which passes them to Session::WriteFolderInterleaved() to send only the rest.
+	 */
+	class FolderReceiver
+	{
+
+	public:
+		/**
+		 * @brief Create the directories and the empty files of 'folder'. Files whose 'rcvd_size' already equals their size are treated as received. 'OnComplete' is called once every byte of the folder has been written.
+		 */
+		FolderReceiver(Folder& folder, std::function<void()> OnComplete = nullptr);
+		~FolderReceiver();
+
+		bool IsValidChunk(const FolderChunkHeader& header);
+
+		/**
+		 * @brief Write a received chunk at its offset. Returns false if the file cannot be written.
+		 */
+		bool WriteChunk(const FolderChunkHeader& header, const char* data);
+
+		/**
+		 * @brief Get the chunks received and verified so far, including those of earlier attempts.
+		 */
+		std::vector<FolderChunkHeader> GetValidChunks();
+
+		bool IsComplete();
+		float GetProgress();
+
+	private:
+		FolderReceiver(const FolderReceiver&) = delete;
+		FolderReceiver& operator=(const FolderReceiver&) = delete;
+
+		/**
+		 * @brief Restore the chunks recorded in the manifest whose data on disk still matches their checksum.
+		 */
+		void LoadManifest();
+
+		std::mutex _mutex;
+		std::vector<std::string> _file_paths;
+		std::vector<size_t> _file_sizes;
+		std::vector<size_t> _rcvd_sizes;
+		std::vector<int> _fds;
+		std::vector<std::vector<bool>> _valid_chunks;
+		std::vector<FolderChunkHeader> _verified_chunks;
+		std::string _manifest_path;
+		int _manifest_fd;
+		size_t _total_size;
+		size_t _rcvd_size;
+
+		std::function<void()> OnComplete;
+	};
+
+
+	struct SharedMemoryRing;
+
+	/**
+	 * @brief Byte stream between two processes on the same host: one ring buffer per direction in POSIX shared memory, each written by one side
+	 * and read by the other. An empty or full ring is waited for on a futex inside the ring, so it works across processes.
+	 * Reads and writes block, so each direction runs on its own thread and the completion handler is called from there.
+	 */
+	class SharedMemoryChannel
+	{
+
+	public:
+		typedef std::function<void(const boost::system::error_code&, size_t)> Handler;
+
+		SharedMemoryChannel();
+		~SharedMemoryChannel();
+
+		/**
+		 * @brief Create the outbound ring under a new name. Returns false if shared memory is not available.
+		 */
+		bool Create();
+
+		/**
+		 * @brief Map the peer's outbound ring as the inbound ring. Returns false if it does not exist or 'token' does not match.
+		 */
+		bool Attach(const std::string& name, uint64_t token);
+
+		/**
+		 * @brief Remove the name of the outbound ring, once the peer has mapped it or declined. The mapping stays.
+		 */
+		void Unlink();
+
+		const std::string& GetName() const;
+		uint64_t GetToken() const;
+		bool IsAttached() const;
+
+		/**
+		 * @brief Fill 'buffers' from the inbound ring, then call 'handler' with boost::asio::error::eof if the channel was closed first.
+		 * At most one read may be pending.
+		 */
+		void AsyncRead(std::vector<boost::asio::mutable_buffer> buffers, Handler handler);
+
+		/**
+		 * @brief Copy 'buffers' into the outbound ring, then call 'handler' with boost::asio::error::broken_pipe if the channel was closed first.
+		 * At most one write may be pending.
+		 */
+		void AsyncWrite(std::vector<boost::asio::const_buffer> buffers, Handler handler);
+
+		/**
+		 * @brief Copy 'buffers' into the outbound ring if there is room for all of them. Returns false, without copying anything, otherwise.
+		 * Must not be called while a write is pending.
+		 */
+		bool TryWrite(const std::vector<boost::asio::const_buffer>& buffers);
+
+		/**
+		 * @brief Close both rings, which fails the pending read and write of both sides.
+		 */
+		void Close();
+
+	private:
+		SharedMemoryChannel(const SharedMemoryChannel&) = delete;
+		SharedMemoryChannel& operator=(const SharedMemoryChannel&) = delete;
+
+		SharedMemoryRing* _outbound;
+		SharedMemoryRing* _inbound;
+		std::string _name;
+		uint64_t _token;
+		bool _is_linked;
+
+		boost::asio::io_service _read_service;
+		boost::asio::io_service _write_service;
+		boost::asio::io_service::work _read_work;
+		boost::asio::io_service::work _write_work;
+		std::unique_ptr<boost::thread> _read_thread;
+		std::unique_ptr<boost::thread> _write_thread;
+	};
+
+
+	class Session : public std::enable_shared_from_this<Session>
+	{
+
+	public:
+		// Payload owned jointly by the caller and the pending write, so it is sent straight from the caller's memory
+		typedef std::shared_ptr<const std::vector<char>> SharedBuffer;
+
 		Session();
 		Session(boost::asio::io_service* io_service, boost::asio::io_service::strand* strand);
 		Session(boost::asio::io_service* io_service, boost::asio::io_service::strand* strand, std::function<void(std::string)> OnConnectionError);
-		~Session();
+		virtual ~Session();
 
 		boost::asio::ip::tcp::socket& GetSocket();
 
 		virtual void Start();
 
+		/**
+		 * @brief Resolve 'ip':'port' and connect, both asynchronously. A failure of either is passed to 'OnConnectionError'.
+		 */
 		void Connect(std::string ip, std::string port, std::function<void()> OnConnected = nullptr, std::function<void(std::string)> OnConnectionError = nullptr);
+
+		/**
+		 * @brief Same as above, with the error code passed to 'OnConnectionError' along with the message. Errors the socket does not know about
+		 * report errc::protocol_error for corrupt data from the peer and the errno or errc::io_error of a failed local file operation.
+		 */
+		void Connect(std::string ip, std::string port, std::function<void()> OnConnected,
+			std::function<void(const boost::system::error_code&, std::string)> OnConnectionError);
+
+		/**
+		 * @brief Close the connection, if any, and connect again to the address of the last Connect(), on the same io_service, strand and thread.
+		 * The callbacks replace those of Connect() once the old connection is stopped as by Stop(), so its aborted operations never report to them.
+		 */
+		void Reconnect(std::function<void()> OnConnected = nullptr, std::function<void(std::string)> OnConnectionError = nullptr);
+
+		/**
+		 * @brief Same as above, with the error code passed to 'OnConnectionError' along with the message.
+		 */
+		void Reconnect(std::function<void()> OnConnected, std::function<void(const boost::system::error_code&, std::string)> OnConnectionError);
+
+		void HandleResolve(const boost::system::error_code& error, boost::asio::ip::tcp::resolver::results_type endpoints);
 		virtual void HandleConnect(const boost::system::error_code& error);
 
 		virtual void HandleRequests(const char* data, size_t size);
+
+		/**
+		 * @brief Read one message: first its length header, then the payload directly into a single pooled buffer of exactly that size,
+		 * which is passed to 'callback' and recycled once the callback returns.
+		 */
+		void ReadMessage(std::function<void(const char*, size_t)> callback);
+		void HandleReadHeader(const boost::system::error_code& error, size_t bytes_transferred, std::function<void(const char*, size_t)> callback);
 		virtual void HandleRead(const boost::system::error_code& error, size_t bytes_transferred, std::function<void(const char*, size_t)> callback);
+
+		/**
+		 * @brief Receive the files announced in 'folder' into TEMP_FOLDER. The sender streams them back to back without padding, in the order of 'folder.files'.
+		 */
+		void ReadFolder(Folder& folder, std::function<void()> callback);
 		void HandleReadFolder(const boost::system::error_code& error, size_t bytes_transferred, Folder& folder, std::function<void()> callback);
+		void CloseReadFile();
+
+		/**
+		 * @brief Receive the chunks of an interleaved folder transfer into 'receiver' until the sender closes the stream of this connection,
+		 * then call 'callback'. With several connections the folder is complete once every one of them has ended.
+		 */
+		void ReadFolderInterleaved(std::shared_ptr<FolderReceiver> receiver, std::function<void()> callback);
+		void HandleReadChunkHeader(const boost::system::error_code& error, size_t bytes_transferred, std::shared_ptr<FolderReceiver> receiver, std::function<void()> callback);
+		void HandleReadChunk(const boost::system::error_code& error, size_t bytes_transferred, std::shared_ptr<FolderReceiver> receiver, std::function<void()> callback);
 		
+		void StartWrite();
 		void HandleWrite(const boost::system::error_code& error, size_t bytes_transferred);
-		void HandleWriteFolder(const boost::system::error_code& error, size_t bytes_transferred);
+		void SendFolderChunk();
+		void SendFolderChunkHeader();
+		void SendFolderFramedChunk();
+		void OnFolderChunkSent(size_t bytes_sent);
+		void FinishFolderTransfer(const boost::system::error_code& error);
+
+		/**
+		 * @brief A file of the folder being sent can't be read: report 'error' through OnSendError and go on with the next queued message.
+		 * An interleaved transfer ends its stream early, the receiver keeps the chunks it has. A plain transfer has no framing to recover from,
+		 * so once some of its bytes are out the connection is closed instead.
+		 */
+		void FailFolderTransfer(std::string error);
+
 		virtual void Write(const char* msg, size_t size);
+		void Write(std::vector<char>&& msg);
+		void Write(SharedBuffer msg);
+
+		/**
+		 * @brief Send a request and get a future for its response. Any number of requests can be in flight on one connection,
+		 * their responses may arrive in any order. The future throws std::runtime_error if the connection fails first.
+		 */
+		std::future<std::vector<char>> SendRequest(const char* msg, size_t size);
+		std::future<std::vector<char>> SendRequest(SharedBuffer msg);
+
+		/**
+		 * @brief Send a request and pass its response to 'OnResponse', or the connection error to 'OnError'. Both run on the session's strand.
+		 */
+		void SendRequest(SharedBuffer msg, std::function<void(const char*, size_t)> OnResponse, std::function<void(std::string)> OnError = nullptr);
+
+		/**
+		 * @brief Answer the request with id 'request_id', which HandleRequests() got from GetRequestId(). Responding later, from any thread, is fine.
+		 */
+		void Respond(uint32_t request_id, const char* msg, size_t size);
+		void Respond(uint32_t request_id, SharedBuffer msg);
+
+		/**
+		 * @brief Get the id of the request being handled by HandleRequests(), or 0 if the message is not a request.
+		 */
+		uint32_t GetRequestId() const;
+
+		/**
+		 * @brief Offer deflate compression to the peer, before connecting. If both peers offer it, payloads of at least SESSION_COMPRESSION_THRESHOLD
+		 * bytes are compressed one by one, on the thread calling Write(), SendRequest() or Respond(), so deflating never holds up the session's strand.
+		 * Payloads that do not shrink by at least 1/SESSION_COMPRESSION_MIN_SAVING are sent as they are.
+		 */
+		void EnableCompression(bool is_enabled = true);
+
+		/**
+		 * @brief Offer shared memory to the peer, before connecting. If the peer is on the same host and offers it too, each direction moves
+		 * to a SharedMemoryChannel right after the handshake and the socket only tells when the peer is gone. OnConnected is called once the
+		 * handshake is done, so that nothing the application sends is mixed into it.
+		 */
+		void EnableSharedMemory(bool is_enabled = true);
+
+		/**
+		 * @brief Close the connection if the peer announces a message, compressed or not, larger than 'max_message_size' bytes,
+		 * instead of allocating a buffer for it. Defaults to SESSION_MAX_MESSAGE_SIZE.
+		 */
+		void SetMaxMessageSize(size_t max_message_size);
+
+		/**
+		 * @brief Get a snapshot of the transport counters. Can be called from any thread.
+		 */
+		SessionStatistics GetStatistics() const;
+
+		/**
+		 * @brief Log the transport counters every 'interval' milliseconds while connected, with the rates over the last interval. 0 turns it off.
+		 */
+		void EnableStatisticsLogging(int interval = SESSION_STATISTICS_LOG_INTERVAL);
+
+		/**
+		 * @brief Queue the files of 'folder' for sending. Each file is streamed with sendfile straight from the page cache to the socket,
+		 * FOLDER_SEND_WINDOW bytes at a time, so memory use does not depend on the folder size.
+		 */
 		void WriteFolder(Folder& folder);
 
+		/**
+		 * @brief Queue the files of 'folder' as FolderChunkHeader framed chunks, sending up to FOLDER_INTERLEAVED_FILES files side by side,
+		 * so that small files do not wait behind a large one. The receiver calls ReadFolderInterleaved().
+		 * To resume a transfer, pass the chunks the receiver reported with FolderReceiver::GetValidChunks(), they are not sent again.
+		 */
+		void WriteFolderInterleaved(Folder& folder, const std::vector<FolderChunkHeader>& valid_chunks = {});
+
+		/**
+		 * @brief Spread the files of 'folder' over several connections to the same receiver, balanced by size, each sent as by WriteFolderInterleaved(Folder&).
+		 */
+		static void WriteFolderInterleaved(Folder& folder, const std::vector<Session*>& sessions, const std::vector<FolderChunkHeader>& valid_chunks = {});
+
+		/**
+		 * @brief Send only the files of 'folder' the receiver does not have yet. The files are hashed on 'pool' and their digests sent as one message;
+		 * the receiver, which called ReadFolderSync(), replies with the files it is missing, which are then queued as by WriteFolder().
+		 * Digests are cached per file while its size and modification time do not change.
+		 */
+		void SyncFolder(Folder& folder, ThreadPool& pool);
+
+		/**
+		 * @brief Receiving side of SyncFolder(): compare the sender's digests with the files under TEMP_FOLDER, hashing them on 'pool',
+		 * reply with the missing or changed files and receive them as by ReadFolder(). Received files take over the sender's modification time,
+		 * so that on the next sync a file of the same size and time is accepted without hashing.
+		 */
+		void ReadFolderSync(Folder& folder, ThreadPool& pool, std::function<void()> callback);
+
+		/**
+		 * @brief Close the connection, drop the queued messages and fail the pending requests. Completions of operations still pending on it
+		 * are ignored, so they can't touch the next connection. Must be called on the strand or while the io thread is not running.
+		 */
 		void Stop();
+
+		/**
+		 * @brief Stop the io thread and replace the io_service and strand, dropping the queued messages and failing the pending requests as Stop() does.
+		 */
 		void Reset();
 
 	protected:
+		/**
+		 * @brief Append a message to the outbound queue. Must be called on the strand.
+		 */
+		void QueueMessage(MessageType type, uint32_t stream_id, SharedBuffer msg, std::chrono::steady_clock::time_point queued_time = std::chrono::steady_clock::now(),
+			uint16_t flags = 0);
+
+		/**
+		 * @brief Pass 'error' to every request still waiting for its response. Must be called on the strand.
+		 */
+		void FailPendingRequests(std::string error);
+
+		/**
+		 * @brief Report a failed connection: fail the pending requests with 'message' and pass both to OnConnectionError. Must be called on the strand.
+		 */
+		void FailConnection(const boost::system::error_code& error, std::string message);
+
+		/**
+		 * @brief Close the connection because of an error the socket does not know about (corrupt data from the peer, a local file error),
+		 * then report it as by FailConnection(). Must be called on the strand.
+		 */
+		void CloseConnection(const boost::system::error_code& error, std::string message);
+
+		/**
+		 * @brief Replace 'msg' by its compressed form if the peer inflates and it is worth it. Returns the frame flags to queue it with.
+		 * Called on the sending thread, before the message is handed to the strand.
+		 */
+		uint16_t Compress(SharedBuffer& msg);
+
+		/**
+		 * @brief Compress 'size' bytes at 'data' as a deflate stream of their own, with a context kept per thread.
+		 */
+		static bool Deflate(const char* data, size_t size, std::vector<char>& compressed);
+
+		/**
+		 * @brief Decompress a frame flagged MESSAGE_FLAG_COMPRESSED into a pooled buffer. Returns false if the data is corrupt.
+		 */
+		bool Inflate(const char* data, size_t size, PooledBuffer& output, size_t& output_size);
+
+		void ResetCompression();
+
+		/**
+		 * @brief Get the digests of 'file_paths', one task per file on 'pool', and pass them to 'callback' on the pool thread finishing last.
+		 * Files flagged in 'skip_hash' only get their size and modification time. An unreadable file gets size UINT64_MAX.
+		 */
+		static void ComputeFileDigests(const std::vector<std::string>& file_paths, ThreadPool& pool, std::function<void(std::vector<FileDigest>)> callback,
+			const std::vector<bool>& skip_hash = {});
+
+		void QueueFolder(Folder& folder, const std::vector<uint32_t>& file_ids, bool is_interleaved, const std::vector<FolderChunkHeader>& valid_chunks);
+
+		/**
+		 * @brief Get a reference for a handler to hold until it has run, so the session outlives it. A session owned by a shared_ptr,
+		 * like every SessionServer session, is deleted once its owner and all of its handlers are done with it.
+		 * Returns nullptr for a session not owned by a shared_ptr, whose owner has to keep it alive until its io_service is stopped.
+		 */
+		std::shared_ptr<Session> KeepAlive();
+
+		/**
+		 * @brief Wrap 'handler' so that it keeps the session alive until it has run.
+		 */
+		template <typename Handler>
+		auto KeepAlive(Handler handler)
+		{
+			return [self = KeepAlive(), handler = std::move(handler)](auto&&... args) mutable { handler(std::forward<decltype(args)>(args)...); };
+		}
+
+		/**
+		 * @brief Wrap 'handler' so that it only runs if the connection it was started on has not been stopped since.
+		 */
+		template <typename Handler>
+		auto OnCurrentConnection(Handler handler)
+		{
+			return [this, connection_id = _connection_id, handler = std::move(handler)](auto&&... args) mutable
+			{
+				if (connection_id == _connection_id)
+					handler(std::forward<decltype(args)>(args)...);
+			};
+		}
+
+		/**
+		 * @brief Bind 'handler' to the strand, with its operation state in the memory kept for reads.
+		 */
+		template <typename Handler>
+		auto BindRead(Handler handler)
+		{
+			auto kept_handler = KeepAlive(OnCurrentConnection(std::move(handler)));
+			return boost::asio::bind_executor(*_strand, AllocatedHandler<decltype(kept_handler)>(_read_handler_memory, std::move(kept_handler)));
+		}
+
+		/**
+		 * @brief Bind 'handler' to the strand, with its operation state in the memory kept for writes.
+		 */
+		template <typename Handler>
+		auto BindWrite(Handler handler)
+		{
+			auto kept_handler = KeepAlive(OnCurrentConnection(std::move(handler)));
+			return boost::asio::bind_executor(*_strand, AllocatedHandler<decltype(kept_handler)>(_write_handler_memory, std::move(kept_handler)));
+		}
+
+		/**
+		 * @brief Completion for the shared memory channel, whose threads call it directly: hand the result over to the handler's executor.
+		 * The pending operation counts as work, so the io thread does not return while only the channel has something outstanding.
+		 * The handler moves along, so the channel's thread never holds the last reference to the session and never deletes it.
+		 */
+		template <typename Handler>
+		SharedMemoryChannel::Handler ToStrand(Handler handler)
+		{
+			auto work = boost::asio::make_work_guard(boost::asio::get_associated_executor(handler));
+
+			return [handler, work](const boost::system::error_code& error, size_t bytes_transferred) mutable
+			{
+				boost::asio::post(work.get_executor(), [handler = std::move(handler), error, bytes_transferred]() mutable { handler(error, bytes_transferred); });
+				work.reset();
+			};
+		}
+
+		/**
+		 * @brief Read from the socket, or from the shared memory channel once the peer writes there. 'handler' comes from BindRead().
+		 */
+		template <typename MutableBuffers, typename Handler>
+		void AsyncRead(const MutableBuffers& buffers, Handler handler)
+		{
+			if (_is_reading_shared_memory)
+			{
+				CountCall(_statistics.read_calls);
+				_shared_memory->AsyncRead(std::vector<boost::asio::mutable_buffer>(boost::asio::buffer_sequence_begin(buffers), boost::asio::buffer_sequence_end(buffers)), ToStrand(handler));
+			}
+			else
+			{
+				boost::asio::async_read(*_socket, buffers, CountCalls(_statistics.read_calls), handler);
+			}
+		}
+
+		/**
+		 * @brief Write to the socket, or to the shared memory channel once the peer reads from there. 'handler' comes from BindWrite().
+		 */
+		template <typename ConstBuffers, typename Handler>
+		void AsyncWrite(const ConstBuffers& buffers, Handler handler)
+		{
+			if (_is_writing_shared_memory)
+			{
+				std::vector<boost::asio::const_buffer> ring_buffers(boost::asio::buffer_sequence_begin(buffers), boost::asio::buffer_sequence_end(buffers));
+				size_t size = boost::asio::buffer_size(buffers);
+
+				CountCall(_statistics.write_calls);
+
+				// What fits into the ring is copied right away, without a round trip through the channel's write thread
+				if (_shared_memory->TryWrite(ring_buffers))
+					_strand->post([handler, size]() mutable { handler(boost::system::error_code(), size); });
+				else
+					_shared_memory->AsyncWrite(std::move(ring_buffers), ToStrand(handler));
+			}
+			else
+			{
+				boost::asio::async_write(*_socket, buffers, CountCalls(_statistics.write_calls), handler);
+			}
+		}
+
+		bool IsPeerLocal();
+
+		/**
+		 * @brief Run 'task' on the strand of a client session, starting its io thread again if the io_service ran out of work.
+		 */
+		void RunOnStrand(std::function<void()> task);
+
+		void Resolve();
+
+		/**
+		 * @brief Add one to the counter 'calls' of '_statistics'.
+		 */
+		void CountCall(uint64_t& calls);
+
+		/**
+		 * @brief Completion condition of the socket reads and writes: transfer everything, as by default, counting each read or write call in 'calls'.
+		 */
+		auto CountCalls(uint64_t& calls)
+		{
+			return [this, &calls](const boost::system::error_code& error, size_t bytes_transferred)
+			{
+				size_t max_size = boost::asio::transfer_all()(error, bytes_transferred);
+				if (max_size > 0)
+					CountCall(calls);
+
+				return max_size;
+			};
+		}
+
+		/**
+		 * @brief Log the counters, then wait for the next interval. Must be called on the strand.
+		 */
+		void LogStatistics();
+
+		/**
+		 * @brief Handle the peer's answer to our shared memory offer, which ends the handshake.
+		 */
+		void HandleSharedMemoryAttached(bool is_peer_attached);
+
+		/**
+		 * @brief Keep a read pending on the socket while both sides read from shared memory, and close the channel once the socket fails.
+		 */
+		void WatchSocket();
+
 		boost::asio::io_service *_io_service;
 		boost::asio::io_service::strand *_strand;
 		boost::asio::ip::tcp::socket *_socket;
 
 		std::array<char, MAX_IP_PACK_SIZE> _read_msg;
-		std::deque<std::array<char, MAX_IP_PACK_SIZE> > _write_msgs;
-		size_t _write_msgs_size;
-		size_t _total_write_size;
 
-		std::deque<std::array<char, MAX_IP_PACK_SIZE> > _read_msgs;
+		struct FolderTransfer
+		{
+			struct FileState
+			{
+				std::string path;
+				size_t size;
+				uint32_t file_id;
+				int fd = -1;
+				off_t offset = 0;
+
+				// Chunks the receiver already holds, indexed by offset / FOLDER_CHUNK_SIZE
+				std::vector<bool> valid_chunks;
+			};
+
+			std::vector<FileState> files;
+			size_t total_size = 0;
+			size_t sent_size = 0;
+
+			// Files being sent side by side, as indices into 'files'; chunks go round robin starting at 'current_file'
+			size_t max_active_files = 1;
+			std::vector<size_t> active_files;
+			size_t current_file = 0;
+			size_t next_file = 0;
+
+			// Interleaved transfers frame every chunk and end with a FOLDER_END_OF_STREAM header
+			bool is_interleaved = false;
+			bool is_end_sent = false;
+			FolderChunkHeader chunk_header;
+			size_t chunk_remaining = 0;
+
+			bool use_sendfile = true;
+			std::vector<char> window;  // Only allocated if sendfile is not supported
+
+			std::string error;  // Set if a file could not be read, the transfer then ends without OnSendComplete
+		};
+
+		struct OutboundMessage
+		{
+			MessageHeader header;
+			SharedBuffer payload;
+			std::shared_ptr<FolderTransfer> folder;  // Set for a queued folder, which is sent on its own instead of 'header' and 'payload'
+			std::chrono::steady_clock::time_point queued_time;  // When Write() was called
+		};
+
+		/**
+		 * @brief Move the offset of 'file' past the chunks the receiver already holds.
+		 */
+		static void SkipValidChunks(FolderTransfer::FileState& file);
+
+		/**
+		 * @brief Close the files 'transfer' is reading from.
+		 */
+		static void CloseFolderFiles(FolderTransfer& transfer);
+
+		/**
+		 * @brief Drop every queued message after a write failed or the connection was stopped. Must be called on the strand.
+		 */
+		void ClearOutboundQueue();
+
+		// Accessed only on the strand; one async_write chain drains it, so Write never blocks
+		std::deque<OutboundMessage> _outbound_msgs;
+		std::vector<boost::asio::const_buffer> _write_buffers;
+		size_t _outbound_in_flight;
+		bool _is_writing;
+		uint64_t _connection_id;  // Incremented by Stop(), see OnCurrentConnection()
+
+		// The callbacks of the read in progress are moved from one handler to the next instead of being copied into each of them
+		std::shared_ptr<HandlerMemory> _read_handler_memory;
+		std::shared_ptr<HandlerMemory> _write_handler_memory;
+		std::function<void(const char*, size_t)> _read_callback;
+		std::function<void()> _read_folder_callback;
+		Folder _read_folder;
+
+		MessageHeader _read_header;
+		PooledBuffer _read_buffer;
+		BufferPool _read_buffer_pool;
+		size_t _max_message_size;
 		size_t _read_msgs_size;
-		size_t _total_read_size;
+
+		// File of the folder currently being received, kept open until its last byte arrives
+		int _read_fd;
+
+		FolderChunkHeader _read_chunk_header;
+
+		struct PendingRequest
+		{
+			std::function<void(const char*, size_t)> OnResponse;
+			std::function<void(std::string)> OnError;
+		};
+
+		// Accessed only on the strand
+		std::unordered_map<uint32_t, PendingRequest> _pending_requests;
+		uint32_t _next_stream_id;
+		uint32_t _current_request_id;
+
+		bool _is_compression_offered;
+		std::atomic<bool> _is_peer_inflating;  // Written on the strand, read by the sending threads
+		std::unique_ptr<z_stream> _inflate_stream;  // Reset for every frame, only its allocations are kept
+
+		// Accessed only on the strand. Each direction switches to the channel on its own, right after its sender's SharedMemoryAttached message
+		std::unique_ptr<SharedMemoryChannel> _shared_memory;
+		std::unique_ptr<boost::asio::steady_timer> _handshake_timer;
+		bool _is_shared_memory_enabled;
+		bool _is_connect_pending;
+		bool _is_attached_sent;
+		std::atomic<bool> _is_peer_attached;  // Also read by the sending threads, which do not compress for shared memory
+		bool _is_reading_shared_memory;
+		bool _is_writing_shared_memory;
+		char _watch_byte;
+
+		// Written on the strand, read by GetStatistics() from any thread
+		SessionStatistics _statistics;
+		mutable std::mutex _statistics_mutex;
+		std::chrono::steady_clock::time_point _connect_time;
+		std::chrono::steady_clock::time_point _read_header_time;
+		std::unique_ptr<boost::asio::steady_timer> _statistics_timer;
+		int _statistics_interval;
+		SessionStatistics _logged_statistics;  // As of the previous log line
 
 		Folder *_folder;
 
+		// Address of the last Connect(), for Reconnect()
+		std::string _ip;
+		std::string _port;
+		std::unique_ptr<boost::asio::ip::tcp::resolver> _resolver;
+
 		std::function<void()> OnConnected;
-		std::function<void(std::string)> OnConnectionError;
+		std::function<void(const boost::system::error_code&, std::string)> OnConnectionError;
 		std::function<void(float)> OnReceiveUpdate;
 		std::function<void(float)> OnSendUpdate;
 		std::function<void()> OnSendComplete;
-
-		std::mutex _mutex_write;
+		std::function<void(std::string)> OnSendError;
 
         boost::thread *_com_thread;
 	};
+
+
+	/**
+	 * @brief Accepts connections and serves all of them from one shared io_service run by a fixed number of threads, instead of one thread per session.
+	 * Every session gets its own strand, so its handlers never run concurrently while different sessions are served in parallel.
+	 * Server sessions must not call Session::Connect() or Session::Reset(), the io_service belongs to the server.
+	 * The server owns its sessions through shared_ptrs and drops them when they are closed; a closed session is deleted once its
+	 * pending handlers have run, so code holding a Session* from a handler of the session may use it for the duration of that handler.
+	 */
+	class SessionServer
+	{
+
+	public:
+		/**
+		 * @brief Creates the session of an accepted connection, which the server takes ownership of. The session must call 'OnConnectionError'
+		 * on errors, as the constructor Session(io_service, strand, OnConnectionError) does, so that the server can close and release it.
+		 */
+		typedef std::function<Session*(boost::asio::io_service*, boost::asio::io_service::strand*, std::function<void(std::string)>)> SessionFactory;
+
+		/**
+		 * @brief Construct the server. 0 threads means one per hardware thread.
+		 */
+		explicit SessionServer(int num_of_threads = 0);
+		~SessionServer();
+
+		/**
+		 * @brief Start accepting connections on 'ip':'port'. If 'factory' is nullptr, plain Session objects are created.
+		 * Throws boost::system::system_error if the address cannot be bound.
+		 */
+		void Listen(std::string ip, std::string port, SessionFactory factory = nullptr);
+
+		/**
+		 * @brief Stop accepting, close every session and join the threads. Calling it again has no effect; the destructor calls it.
+		 */
+		void Stop();
+
+		size_t GetNumberOfSessions();
+
+	private:
+		struct ServerSession
+		{
+			std::shared_ptr<Session> session;  // Deletes the session's strand along with it
+			bool is_connected = false;
+		};
+
+		SessionServer(const SessionServer&) = delete;
+		SessionServer& operator=(const SessionServer&) = delete;
+
+		void StartAccept();
+		void HandleAccept(uint64_t session_id, std::shared_ptr<Session> session, boost::asio::io_service::strand* strand, const boost::system::error_code& error);
+
+		/**
+		 * @brief Close the connection of a session and release it. Does nothing if it was released already.
+		 */
+		void CloseSession(uint64_t session_id, std::string error);
+
+		boost::asio::io_service _io_service;
+		std::unique_ptr<boost::asio::io_service::work> _work;
+		boost::asio::ip::tcp::acceptor _acceptor;
+		boost::thread_group _threads;
+		int _num_of_threads;
+
+		SessionFactory _factory;
+
+		std::mutex _sessions_mutex;
+		std::unordered_map<uint64_t, ServerSession> _sessions;
+		uint64_t _next_session_id;
+		bool _is_stopped;
+	};
+
+
+	/**
+	 * @brief Client sessions kept connected per endpoint. A session acquired from the pool belongs to the caller until Release(), and
+	 * SESSION_POOL_SPARES more per endpoint are kept connected, so that acquiring does not wait for a connection. A session whose connection
+	 * drops is reconnected in the background, at once and then with exponential backoff, keeping its io_service, strand and thread.
+	 */
+	class SessionPool
+	{
+
+	public:
+		/**
+		 * @brief Creates an unconnected client session, set up as needed (e.g. EnableCompression()) before the pool connects it.
+		 * The pool sets the session's OnConnected and OnConnectionError callbacks.
+		 */
+		typedef std::function<Session*()> SessionFactory;
+
+		/**
+		 * @brief Construct the pool. If 'factory' is nullptr, plain Session objects are created.
+		 */
+		explicit SessionPool(SessionFactory factory = nullptr, size_t num_of_spares = SESSION_POOL_SPARES);
+		~SessionPool();
+
+		/**
+		 * @brief Get a connected session to 'ip':'port'. The future is ready at once if one is idle, otherwise as soon as one connects;
+		 * it keeps waiting while the endpoint cannot be reached, use wait_for() to give up. It throws std::runtime_error if the pool stops first.
+		 */
+		std::future<std::shared_ptr<Session>> Acquire(std::string ip, std::string port);
+
+		/**
+		 * @brief Give back a session from Acquire(). It goes to the next caller waiting for its endpoint once it is connected.
+		 */
+		void Release(std::shared_ptr<Session> session);
+
+		/**
+		 * @brief Stop reconnecting and reset every session; sessions still held by callers stay valid but disconnected.
+		 * Calling it again has no effect; the destructor calls it.
+		 */
+		void Stop();
+
+		/**
+		 * @brief Get the number of connected sessions to 'ip':'port', in use or not.
+		 */
+		size_t GetNumberOfSessions(std::string ip, std::string port);
+
+	private:
+		struct Endpoint;
+
+		struct PooledSession
+		{
+			std::shared_ptr<Session> session;
+			Endpoint* endpoint;
+			std::unique_ptr<boost::asio::steady_timer> reconnect_timer;
+
+			uint64_t attempt = 0;  // Errors reported with an older attempt number are about a connection already given up
+			int backoff = SESSION_POOL_BACKOFF_MIN;  // Milliseconds before retrying if the current attempt fails
+			bool is_connected = false;
+			bool is_in_use = false;
+		};
+
+		struct Endpoint
+		{
+			std::string ip;
+			std::string port;
+			std::list<PooledSession> sessions;
+			std::deque<std::shared_ptr<std::promise<std::shared_ptr<Session>>>> waiting;  // Acquire() calls that found no idle session
+		};
+
+		SessionPool(const SessionPool&) = delete;
+		SessionPool& operator=(const SessionPool&) = delete;
+
+		/**
+		 * @brief Create sessions until the ones not in use cover the waiting callers and the spares. Must be called with '_mutex' held.
+		 */
+		void AddSpares(Endpoint& endpoint);
+
+		/**
+		 * @brief Start a new connection attempt of 'pooled_session'. Must be called with '_mutex' held.
+		 */
+		void Connect(PooledSession* pooled_session);
+		void HandleConnect(PooledSession* pooled_session, uint64_t attempt);
+		void HandleConnectionError(PooledSession* pooled_session, uint64_t attempt, const boost::system::error_code& error);
+		void HandleReconnectTimer(PooledSession* pooled_session, const boost::system::error_code& error);
+
+		/**
+		 * @brief Hand 'pooled_session' to the first waiting caller, if any. Must be called with '_mutex' held.
+		 */
+		void HandOver(PooledSession* pooled_session);
+
+		boost::asio::io_service _io_service;
+		std::unique_ptr<boost::asio::io_service::work> _work;
+		boost::thread _thread;
+
+		SessionFactory _factory;
+		size_t _num_of_spares;
+
+		std::mutex _mutex;
+		std::unordered_map<std::string, Endpoint> _endpoints;
+		bool _is_stopped;
+	};
 }
\ No newline at end of file
@@ -0,0 +1,384 @@
+/**
+ * Loopback benchmark of rtkcommunication::Session: a SessionServer and a client Session talking over 127.0.0.1, no external services needed.
+ *
+ * Workloads:
+ *  - latency:            round trip of a SendRequest() echoed by the server, 64 B to 64 KB payloads, percentiles in microseconds
+ *  - bulk:               one-way throughput of Write() with 1 MB to 1 GB messages (limited by --max-bulk-mb)
+ *  - folder_sequential:  WriteFolder() of a generated folder of many small and a few large files
+ *  - folder_interleaved: WriteFolderInterleaved() of the same folder
+ *
+ * The benchmark runs in a fresh directory under /tmp, which holds the generated folder and the receiver's TEMP_FOLDER, and is removed afterwards.
+ *
+ * Client and server share the host, so the connection moves to shared memory unless --tcp is given.
+ *
+ * Usage: SessionBenchmark [--port=N] [--format=csv|json] [--scale=F] [--max-bulk-mb=N] [--compression] [--tcp]
+ * Results are written to stdout, one row per (workload, size, metric).
+ */
+
+#include "rtkcommunication/Common/Session.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace rtkcommunication;
+
+
+namespace
+{
+	typedef std::chrono::steady_clock Clock;
+
+	// First byte of a benchmark request, telling the server what to do with it
+	const char COMMAND_ECHO = 'E';
+	const char COMMAND_SYNC = 'S';
+	const char COMMAND_FOLDER_SEQUENTIAL = 'F';
+	const char COMMAND_FOLDER_INTERLEAVED = 'I';
+
+	struct Result
+	{
+		std::string workload;
+		size_t size;
+		std::string metric;
+		double value;
+		std::string unit;
+	};
+
+
+	double SecondsSince(const Clock::time_point start)
+	{
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+
+	double Percentile(std::vector<double> samples, const double percentile)
+	{
+		if (samples.empty() == true)
+			return 0;
+
+		std::sort(samples.begin(), samples.end());
+		size_t index = (size_t)(percentile / 100.0 * (double)(samples.size() - 1));
+
+		return samples[index];
+	}
+
+
+	/**
+	 * @brief Random bytes, so that the numbers with --compression show the incompressible worst case.
+	 */
+	Session::SharedBuffer MakePayload(const size_t size, const char command = 0)
+	{
+		std::vector<char> payload(size);
+
+		std::mt19937_64 generator(size);
+		for (size_t i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+		{
+			uint64_t value = generator();
+			std::memcpy(payload.data() + i, &value, sizeof(uint64_t));
+		}
+
+		if (size > 0 && command != 0)
+			payload[0] = command;
+
+		return std::make_shared<const std::vector<char>>(std::move(payload));
+	}
+
+
+	/**
+	 * @brief Server side: echoes requests, answers sync requests once everything sent before has arrived, and receives folders on demand.
+	 */
+	class BenchmarkSession : public Session
+	{
+
+	public:
+		BenchmarkSession(boost::asio::io_service* io_service, boost::asio::io_service::strand* strand, std::function<void(std::string)> OnConnectionError, Folder& folder)
+			: Session(io_service, strand, OnConnectionError),
+			folder(folder)
+		{
+		}
+
+		void HandleRequests(const char* data, size_t size) override
+		{
+			uint32_t request_id = GetRequestId();
+
+			if (request_id == 0 || size == 0)
+			{
+				ReadNext();
+				return;
+			}
+
+			switch (data[0])
+			{
+			case COMMAND_ECHO:
+				Respond(request_id, data, size);
+				break;
+
+			case COMMAND_SYNC:
+				// Messages arrive in order, so every bulk message sent before this request has been received
+				Respond(request_id, data, 1);
+				break;
+
+			case COMMAND_FOLDER_SEQUENTIAL:
+				// The folder follows this request on the same stream, so reading switches over before the next message is read
+				ReadFolder(folder, [this, request_id]()
+				{
+					Respond(request_id, "F", 1);
+					ReadNext();
+				});
+				return;
+
+			case COMMAND_FOLDER_INTERLEAVED:
+				ReadFolderInterleaved(std::make_shared<FolderReceiver>(folder), [this, request_id]()
+				{
+					Respond(request_id, "I", 1);
+					ReadNext();
+				});
+				return;
+			}
+
+			ReadNext();
+		}
+
+	private:
+		void ReadNext()
+		{
+			ReadMessage([this](const char* data, size_t size) { HandleRequests(data, size); });
+		}
+
+		Folder& folder;
+	};
+
+
+	///////////////////////////////////////////////////////////////////////// workloads
+
+	void Latency(Session& client, const size_t num_of_round_trips, std::vector<Result>& results)
+	{
+		for (size_t size = 64; size <= 65536; size *= 4)
+		{
+			Session::SharedBuffer payload = MakePayload(size, COMMAND_ECHO);
+
+			for (size_t i = 0; i < 100; i++)
+				client.SendRequest(payload).get();
+
+			std::vector<double> samples;
+			samples.reserve(num_of_round_trips);
+
+			for (size_t i = 0; i < num_of_round_trips; i++)
+			{
+				Clock::time_point start = Clock::now();
+				client.SendRequest(payload).get();
+				samples.push_back(SecondsSince(start) * 1e6);
+			}
+
+			results.push_back({ "latency", size, "p50", Percentile(samples, 50), "us" });
+			results.push_back({ "latency", size, "p90", Percentile(samples, 90), "us" });
+			results.push_back({ "latency", size, "p99", Percentile(samples, 99), "us" });
+			results.push_back({ "latency", size, "max", Percentile(samples, 100), "us" });
+		}
+	}
+
+
+	void Bulk(Session& client, const size_t max_size, const size_t total_size, std::vector<Result>& results)
+	{
+		Session::SharedBuffer sync = MakePayload(1, COMMAND_SYNC);
+
+		for (size_t size = 1 << 20; size <= max_size; size *= 16)
+		{
+			Session::SharedBuffer payload = MakePayload(size);
+			size_t num_of_messages = std::max<size_t>(total_size / size, 1);
+
+			Clock::time_point start = Clock::now();
+
+			// Every Write() shares the same buffer, so the numbers measure the transport and not the copying
+			for (size_t i = 0; i < num_of_messages; i++)
+				client.Write(payload);
+
+			client.SendRequest(sync).get();
+			double seconds = SecondsSince(start);
+
+			results.push_back({ "bulk", size, "throughput", (double)(num_of_messages * size) / seconds / 1e6, "MB/s" });
+
+			// Sixteenfold steps, but always end with 'max_size' itself (1 MB, 16 MB, 256 MB, then 1 GB by default)
+			if (size * 16 > max_size && size < max_size)
+				size = max_size / 16;
+		}
+	}
+
+
+	Folder GenerateFolder(const std::string& folder_path, const double scale)
+	{
+		Folder folder;
+		folder.folder_path = folder_path;
+
+		std::filesystem::create_directories(folder_path);
+		std::mt19937 generator(42);
+
+		size_t num_of_small_files = std::max<size_t>((size_t)(2000 * scale), 1);
+		size_t num_of_large_files = 4;
+		size_t large_file_size = std::max<size_t>((size_t)(128 * scale), 1) << 20;
+
+		for (size_t i = 0; i < num_of_small_files + num_of_large_files; i++)
+		{
+			// DICOM-slice sized files in a few subfolders, then a few large volumes
+			File file;
+			file.file_name = i < num_of_small_files ? "series_" + std::to_string(i % 8) + "/slice_" + std::to_string(i) + ".dcm" : "volume_" + std::to_string(i) + ".raw";
+			file.size = i < num_of_small_files ? 4096 + generator() % (512 * 1024) : large_file_size;
+			file.rcvd_size = 0;
+
+			std::filesystem::create_directories(std::filesystem::path(folder_path + "/" + file.file_name).parent_path());
+
+			Session::SharedBuffer data = MakePayload(file.size);
+			std::ofstream output(folder_path + "/" + file.file_name, std::ios::binary);
+			output.write(data->data(), data->size());
+
+			folder.files.push_back(file);
+		}
+
+		return folder;
+	}
+
+
+	void FolderTransfer(Session& client, Folder& folder, const bool is_interleaved, std::vector<Result>& results)
+	{
+		std::filesystem::remove_all(TEMP_FOLDER);
+
+		Session::SharedBuffer command = MakePayload(1, is_interleaved ? COMMAND_FOLDER_INTERLEAVED : COMMAND_FOLDER_SEQUENTIAL);
+
+		Clock::time_point start = Clock::now();
+
+		std::future<std::vector<char>> done = client.SendRequest(command);
+		if (is_interleaved)
+			client.WriteFolderInterleaved(folder);
+		else
+			client.WriteFolder(folder);
+
+		done.get();
+		double seconds = SecondsSince(start);
+
+		std::string workload = is_interleaved ? "folder_interleaved" : "folder_sequential";
+		results.push_back({ workload, folder.GetTotalSize(), "throughput", (double)folder.GetTotalSize() / seconds / 1e6, "MB/s" });
+		results.push_back({ workload, folder.GetTotalSize(), "files_per_second", (double)folder.files.size() / seconds, "files/s" });
+	}
+
+
+	///////////////////////////////////////////////////////////////////////// output
+
+	void PrintCsv(const std::vector<Result>& results)
+	{
+		std::cout << "workload,size,metric,value,unit\n";
+
+		for (const Result& result : results)
+		{
+			std::cout << result.workload << "," << result.size << "," << result.metric << "," << result.value << "," << result.unit << "\n";
+		}
+	}
+
+
+	void PrintJson(const std::vector<Result>& results)
+	{
+		std::cout << "[\n";
+
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			const Result& result = results[i];
+
+			std::cout << "  {\"workload\": \"" << result.workload << "\", \"size\": " << result.size << ", \"metric\": \"" << result.metric
+				<< "\", \"value\": " << result.value << ", \"unit\": \"" << result.unit << "\"}"
+				<< (i + 1 < results.size() ? "," : "") << "\n";
+		}
+
+		std::cout << "]\n";
+	}
+}
+
+
+int main(int argc, char* argv[])
+{
+	std::string port = "38600";
+	std::string format = "csv";
+	double scale = 1.0;
+	size_t max_bulk_size = (size_t)1024 << 20;
+	bool is_compression_enabled = false;
+	bool is_shared_memory_enabled = true;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::strncmp(argv[i], "--port=", 7) == 0)
+			port = argv[i] + 7;
+		else if (std::strncmp(argv[i], "--format=", 9) == 0)
+			format = argv[i] + 9;
+		else if (std::strncmp(argv[i], "--scale=", 8) == 0)
+			scale = std::stod(argv[i] + 8);
+		else if (std::strncmp(argv[i], "--max-bulk-mb=", 14) == 0)
+			max_bulk_size = (size_t)std::max(std::stoi(argv[i] + 14), 1) << 20;
+		else if (std::strcmp(argv[i], "--compression") == 0)
+			is_compression_enabled = true;
+		else if (std::strcmp(argv[i], "--tcp") == 0)
+			is_shared_memory_enabled = false;
+		else
+		{
+			std::cerr << "Usage: " << argv[0] << " [--port=N] [--format=csv|json] [--scale=F] [--max-bulk-mb=N] [--compression] [--tcp]" << std::endl;
+			return 1;
+		}
+	}
+
+	// TEMP_FOLDER is relative, keep it and the generated folder out of the caller's directory
+	char work_directory[] = "/tmp/session_benchmark_XXXXXX";
+	if (mkdtemp(work_directory) == nullptr || chdir(work_directory) != 0)
+	{
+		std::cerr << "Cannot create a working directory under /tmp" << std::endl;
+		return 1;
+	}
+
+	std::vector<Result> results;
+
+	{
+		Folder folder = GenerateFolder("benchmark_folder", scale);
+
+		SessionServer server(1);
+		server.Listen("127.0.0.1", port, [&folder, is_compression_enabled, is_shared_memory_enabled](boost::asio::io_service* io_service, boost::asio::io_service::strand* strand,
+			std::function<void(std::string)> OnConnectionError)
+		{
+			BenchmarkSession* session = new BenchmarkSession(io_service, strand, OnConnectionError, folder);
+			session->EnableCompression(is_compression_enabled);
+			session->EnableSharedMemory(is_shared_memory_enabled);
+
+			return session;
+		});
+
+		Session client;
+		client.EnableCompression(is_compression_enabled);
+		client.EnableSharedMemory(is_shared_memory_enabled);
+
+		std::promise<void> connected;
+		client.Connect("127.0.0.1", port, [&connected]() { connected.set_value(); });
+		connected.get_future().get();
+
+		Latency(client, (size_t)(2000 * scale), results);
+		Bulk(client, max_bulk_size, (size_t)((double)((size_t)2048 << 20) * scale), results);
+		FolderTransfer(client, folder, false, results);
+		FolderTransfer(client, folder, true, results);
+
+		client.Reset();
+		server.Stop();
+	}
+
+	std::filesystem::current_path("/tmp");
+	std::filesystem::remove_all(work_directory);
+
+	if (format == "json")
+		PrintJson(results);
+	else
+		PrintCsv(results);
+
+	return 0;
+}
\ No newline at end of file
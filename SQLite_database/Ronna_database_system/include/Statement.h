@@ -34,15 +34,20 @@ public:
     ~Statement();
 
 public:
-    // TODO: void beginTransaction();
-    // TODO: void endTransaction();
-
     /**
-     * @brief Prepare a statement.
+     * @brief Prepare a statement. A statement that is already prepared, like the ones handed out by Database::createStatement(),
+     * is only reset, so that the SQL is compiled once.
      * 
      */
     void prepare();
 
+    /**
+     * @brief Reset a prepared statement so that it can be evaluated again, and clear its bound values.
+     * Does nothing if statement is not prepared.
+     * 
+     */
+    void reset();
+
     /**
      * @brief Bind a string value to a prepared statement.
      * Throws SQLException if statement is not prepared.
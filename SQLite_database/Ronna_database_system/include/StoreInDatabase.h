@@ -1,6 +1,7 @@
 #pragma once
 
 #include <filesystem>
+#include <memory>
 
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
@@ -13,15 +14,17 @@
 namespace rtkplanning
 {
 
+class Transaction;
+
 class StoreInDatabase
 {
 public:
     using dict_type = const itk::MetaDataDictionary&;
 
     long long StorePatientInDb(dict_type dictionary) const;
-    void StoreStudyInDb(dict_type dictionary, long long patient_UID) const;
-    void StoreSeriesInDb(dict_type dictionary, std::string series_inst_UID_value) const;
-    void StoreImageInDb(dict_type dictionary, const std::filesystem::path& file_path) const;
+    bool StoreStudyInDb(dict_type dictionary, long long patient_UID) const;
+    bool StoreSeriesInDb(dict_type dictionary, std::string series_inst_UID_value) const;
+    bool StoreImageInDb(dict_type dictionary, const std::filesystem::path& file_path) const;
 
     StoreInDatabase();
 
@@ -29,4 +32,63 @@ private:
     std::shared_ptr<spdlog::logger> logger_planning = nullptr;
 };
 
+/**
+ * @brief Class storing a batch of DICOM files in the database. Files are grouped into transactions of batch_size files
+ * instead of every insert committing, and syncing the journal, on its own. Each file is stored inside of a savepoint,
+ * so a file that fails to be stored leaves no rows behind and doesn't undo the other files of its batch.
+ * Files stored since the last commit are only in the database once Commit() returns true, so callers have to commit explicitly.
+ * 
+ */
+class ImportSession
+{
+public:
+    using dict_type = StoreInDatabase::dict_type;
+
+    /**
+     * @brief Construct a new ImportSession object
+     * 
+     * @param batch_size number of files stored in one transaction
+     */
+    explicit ImportSession(size_t batch_size = 500);
+
+    /**
+     * @brief Destroy the ImportSession object and roll back files stored since the last commit.
+     * 
+     */
+    ~ImportSession();
+
+    ImportSession(const ImportSession&) = delete;
+    ImportSession& operator=(const ImportSession&) = delete;
+
+    /**
+     * @brief Store patient, study, series and image of a DICOM file.
+     * 
+     * @param dictionary metadata dictionary of the file
+     * @param file_path path of the file
+     * @return true if file was stored in the open transaction, which is provisional until the next Commit() returns true
+     * @return false if file was failed to be stored and its changes were rolled back
+     */
+    bool StoreFile(dict_type dictionary, const std::filesystem::path& file_path);
+
+    /**
+     * @brief Commit files stored since the last commit. Also called after every batch_size files; a batch lost that way,
+     * or by an error that rolled back the whole transaction, makes the next call return false.
+     * 
+     * @return true if every file StoreFile() returned true for since the last call is in the database
+     * @return false if some of them were rolled back
+     */
+    bool Commit();
+
+private:
+    bool CommitBatch();
+
+private:
+    StoreInDatabase store;
+    std::unique_ptr<Transaction> transaction;
+    size_t batch_size;
+    size_t files_in_batch = 0;
+    bool is_batch_lost = false;
+    std::shared_ptr<spdlog::logger> logger_planning = nullptr;
+};
+
 }
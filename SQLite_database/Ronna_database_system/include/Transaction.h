@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+
+namespace rtkplanning
+{
+
+/**
+ * @brief Class representing an SQL transaction on the database connection.
+ * A transaction that is neither committed nor rolled back is rolled back when the object is destroyed.
+ * Transactions can't be nested, savepoints are used for that inside of a transaction.
+ *
+ */
+class Transaction
+{
+public:
+
+    /**
+     * @brief Construct a new Transaction object and begin the transaction.
+     * Throws SQLException if transaction can't be started.
+     *
+     */
+    Transaction();
+
+    /**
+     * @brief Destroy the Transaction object and roll back the transaction if it is still active.
+     *
+     */
+    ~Transaction();
+
+    Transaction(const Transaction&) = delete;
+    Transaction& operator=(const Transaction&) = delete;
+
+public:
+
+    /**
+     * @brief Commit the transaction.
+     * Throws SQLException if transaction is not active or commit failed, in which case transaction stays active.
+     *
+     */
+    void commit();
+
+    /**
+     * @brief Roll back the transaction. Does nothing if transaction is not active.
+     * Throws SQLException if rollback failed.
+     *
+     */
+    void rollback();
+
+    /**
+     * @brief Start a savepoint with given name inside of the transaction.
+     * Throws SQLException if savepoint can't be started.
+     *
+     * @param name name of the savepoint
+     */
+    void savepoint(const std::string& name);
+
+    /**
+     * @brief Release a savepoint with given name, keeping its changes in the transaction.
+     * Throws SQLException if savepoint can't be released.
+     *
+     * @param name name of the savepoint
+     */
+    void release(const std::string& name);
+
+    /**
+     * @brief Undo the changes made since a savepoint with given name. Savepoint itself stays open and has to be released.
+     * Throws SQLException if rollback failed.
+     *
+     * @param name name of the savepoint
+     */
+    void rollbackTo(const std::string& name);
+
+    /**
+     * @brief Check if transaction is neither committed nor rolled back.
+     *
+     * @return true if transaction is active
+     * @return false if transaction is not active
+     */
+    bool isActive() const;
+
+private:
+    void execute(const std::string& query);
+
+private:
+    bool active;
+};
+
+}
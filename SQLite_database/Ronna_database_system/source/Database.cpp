@@ -4,12 +4,32 @@
 #include <gio/gio.h>
 #include <exception>
 #include <iostream>
+#include <mutex>
 #include <sstream>
+#include <unordered_map>
+#include <vector>
 
 using namespace rtkplanning;
 
 namespace fs = std::filesystem;
 
+namespace
+{
+
+/**
+ * @brief Prepared statements not in use, by their SQL text. Database is a singleton, so there is one cache for its connection.
+ */
+struct StatementCache
+{
+    std::mutex mutex;
+    std::unordered_map<std::string, std::vector<std::unique_ptr<Statement>>> statements;
+    bool closed = false;
+};
+
+StatementCache statementCache;
+
+}
+
 Database& Database::getInstance()
 {
     static Database instance;
@@ -35,6 +55,13 @@ Database::Database()
 
 Database::~Database()
 {
+    {
+        // Statements have to be finalized before the connection can be closed
+        std::lock_guard<std::mutex> lock(statementCache.mutex);
+        statementCache.statements.clear();
+        statementCache.closed = true;
+    }
+
     sqlite3_close(db);
 }
 
@@ -65,7 +92,42 @@ void Database::createTables()
 
 std::shared_ptr<Statement> Database::createStatement(const std::string& query)
 {
-    return std::make_shared<Statement>(db, query);
+    std::unique_ptr<Statement> statement;
+    std::vector<std::unique_ptr<Statement>>* cached;
+
+    {
+        std::lock_guard<std::mutex> lock(statementCache.mutex);
+
+        // Elements of an unordered_map stay where they are, so the deleter below can keep a pointer to the list
+        cached = &statementCache.statements[query];
+        if(!cached->empty())
+        {
+            statement = std::move(cached->back());
+            cached->pop_back();
+        }
+    }
+
+    // A statement with the same SQL that is still in use, e.g. by a caller up the stack, gets a second one
+    if(!statement)
+    {
+        statement = std::make_unique<Statement>(db, query);
+    }
+
+    // Once the caller is done, the statement is reset, so that it holds no lock on the database while it waits in the cache
+    return std::shared_ptr<Statement>(statement.release(), [cached](Statement* statement)
+    {
+        statement->reset();
+
+        std::lock_guard<std::mutex> lock(statementCache.mutex);
+
+        if(statementCache.closed)
+        {
+            delete statement;
+            return;
+        }
+
+        cached->emplace_back(statement);
+    });
 }
 
 long long Database::getLastInsertedRowID()
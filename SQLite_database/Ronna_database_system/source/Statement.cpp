@@ -7,7 +7,9 @@ using namespace rtkplanning;
 
 Statement::Statement(sqlite3* db, const std::string& query) :
     db(db),
-    query(query)
+    stmt(nullptr),
+    query(query),
+    prepared(false)
 {
 }
 
@@ -18,6 +20,12 @@ Statement::~Statement()
 
 void Statement::prepare()
 {
+    if(prepared)
+    {
+        reset();
+        return;
+    }
+
     int result = sqlite3_prepare_v2(db, query.c_str(), query.length(), &stmt, NULL);
     if(result != SQLITE_OK)
     {
@@ -27,6 +35,14 @@ void Statement::prepare()
     prepared = true;
 }
 
+void Statement::reset()
+{
+    if(!prepared) return;
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
+
 void Statement::bind(int pos, const std::string& value)
 {
     if(!prepared)
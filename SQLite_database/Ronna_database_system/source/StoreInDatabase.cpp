@@ -6,6 +6,8 @@
 #include "Series.h"
 #include "Image.h"
 #include "Statement.h"
+#include "Transaction.h"
+#include "SQLException.h"
 
 using namespace rtkplanning;
 
@@ -47,7 +49,7 @@ long long StoreInDatabase::StorePatientInDb(dict_type dictionary) const
     return patient_UID;
 }
 
-void StoreInDatabase::StoreStudyInDb(dict_type dictionary, long long patient_UID) const
+bool StoreInDatabase::StoreStudyInDb(dict_type dictionary, long long patient_UID) const
 {
     try
     {
@@ -65,16 +67,20 @@ void StoreInDatabase::StoreStudyInDb(dict_type dictionary, long long patient_UID
             study->PatientUID            = patient_UID;
 
             SPDLOG_LOGGER_INFO(logger_planning, "Study with StudyInstanceUID {} doesn't exist in database.", study->StudyInstanceUID);
-            Study::insert(*study);
+            return Study::insert(*study);
         }
+
+        return true;
     }
     catch (const std::exception& e)
     {
         SPDLOG_LOGGER_ERROR(logger_planning, "Exception while storing study data into database: {}!", e.what());
     }
+
+    return false;
 }
 
-void StoreInDatabase::StoreSeriesInDb(dict_type dictionary, std::string series_inst_UID_value) const
+bool StoreInDatabase::StoreSeriesInDb(dict_type dictionary, std::string series_inst_UID_value) const
 {
     try
     {
@@ -92,16 +98,20 @@ void StoreInDatabase::StoreSeriesInDb(dict_type dictionary, std::string series_i
             series->StudyInstanceUID     = rtkcommon::DCMReader::getTagValue(dictionary, rtkcommon::DCMReader::tagStudyInstanceUID).value();
 
             SPDLOG_LOGGER_INFO(logger_planning, "Series with SeriesInstanceUID {} doesn't exist in database.", series_inst_UID_value);
-            Series::insert(*series);
+            return Series::insert(*series);
         }
+
+        return true;
     }
     catch (const std::exception& e)
     {
         SPDLOG_LOGGER_ERROR(logger_planning, "Exception while storing series into database: {}!", e.what());
     }
+
+    return false;
 }
 
-void StoreInDatabase::StoreImageInDb(dict_type dictionary, const std::filesystem::path& file_path) const
+bool StoreInDatabase::StoreImageInDb(dict_type dictionary, const std::filesystem::path& file_path) const
 {
     auto sop_instance_UID = rtkcommon::DCMReader::getTagValue(dictionary, rtkcommon::DCMReader::tagSOPInstanceUID);
     auto series_inst_UID = rtkcommon::DCMReader::getTagValue(dictionary, rtkcommon::DCMReader::tagSeriesInstanceUID);
@@ -113,10 +123,117 @@ void StoreInDatabase::StoreImageInDb(dict_type dictionary, const std::filesystem
         image.Filename              = file_path.string();
         image.SeriesInstanceUID     = series_inst_UID.value();
 
-        Image::insert(image);
+        return Image::insert(image);
     }
     catch (const std::exception& e)
     {
         SPDLOG_LOGGER_ERROR(logger_planning, "Exception while storing image {} into database: {}!", file_path.string(), e.what());
     }
+
+    return false;
+}
+
+ImportSession::ImportSession(size_t batch_size) :
+    batch_size(batch_size)
+{
+    logger_planning = spdlog::get("rtkplanning");
+}
+
+ImportSession::~ImportSession()
+{
+    // Transaction rolls itself back, a destructor has no way to report a failed commit
+    if (transaction && files_in_batch > 0)
+        SPDLOG_LOGGER_WARN(logger_planning, "Rolling back {} imported files that were not committed!", files_in_batch);
+}
+
+bool ImportSession::StoreFile(dict_type dictionary, const std::filesystem::path& file_path)
+{
+    try
+    {
+        if (!transaction)
+            transaction = std::make_unique<Transaction>();
+
+        transaction->savepoint("import_file");
+    }
+    catch (const SQLException& e)
+    {
+        SPDLOG_LOGGER_ERROR(logger_planning, "Exception while starting import of {}: {}!", file_path.string(), e.what());
+        return false;
+    }
+
+    bool stored = false;
+    try
+    {
+        auto series_inst_UID = rtkcommon::DCMReader::getTagValue(dictionary, rtkcommon::DCMReader::tagSeriesInstanceUID);
+        long long patient_UID = store.StorePatientInDb(dictionary);
+
+        stored = patient_UID != 0
+            && store.StoreStudyInDb(dictionary, patient_UID)
+            && store.StoreSeriesInDb(dictionary, series_inst_UID.value())
+            && store.StoreImageInDb(dictionary, file_path);
+    }
+    catch (const std::exception& e)
+    {
+        SPDLOG_LOGGER_ERROR(logger_planning, "Exception while storing {} into database: {}!", file_path.string(), e.what());
+    }
+
+    try
+    {
+        // Undo rows of a partially stored file, the savepoint has to be released after it is rolled back to
+        if (!stored)
+            transaction->rollbackTo("import_file");
+
+        transaction->release("import_file");
+    }
+    catch (const SQLException& e)
+    {
+        // Error SQLite couldn't confine to a single statement already rolled back the whole transaction
+        SPDLOG_LOGGER_ERROR(logger_planning, "Exception while importing {}, {} files of the batch were not stored: {}!",
+            file_path.string(), files_in_batch + 1, e.what());
+        transaction.reset();
+        files_in_batch = 0;
+        is_batch_lost = true;
+        return false;
+    }
+
+    ++files_in_batch;
+
+    // File is lost with its batch if the commit fails, the next Commit() reports that as well
+    if (files_in_batch >= batch_size && !CommitBatch())
+        return false;
+
+    return stored;
+}
+
+bool ImportSession::Commit()
+{
+    bool committed = CommitBatch() && !is_batch_lost;
+    is_batch_lost = false;
+
+    return committed;
+}
+
+bool ImportSession::CommitBatch()
+{
+    if (!transaction)
+        return true;
+
+    bool committed = false;
+    try
+    {
+        transaction->commit();
+        committed = true;
+        SPDLOG_LOGGER_INFO(logger_planning, "Committed {} imported files to database.", files_in_batch);
+    }
+    catch (const SQLException& e)
+    {
+        SPDLOG_LOGGER_ERROR(logger_planning, "Exception while committing {} imported files: {}!", files_in_batch, e.what());
+        is_batch_lost = true;
+    }
+
+    // Transaction that failed to commit is rolled back
+    transaction.reset();
+    files_in_batch = 0;
+
+    return committed;
 }
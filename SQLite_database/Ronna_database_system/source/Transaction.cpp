@@ -0,0 +1,72 @@
+#include "Transaction.h"
+#include "Database.h"
+#include "SQLException.h"
+#include "Statement.h"
+
+using namespace rtkplanning;
+
+Transaction::Transaction() :
+    active(false)
+{
+    execute("BEGIN");
+    active = true;
+}
+
+Transaction::~Transaction()
+{
+    try
+    {
+        rollback();
+    }
+    catch(const SQLException&)
+    {
+        // SQLite already ended the transaction because of an error
+    }
+}
+
+void Transaction::commit()
+{
+    if(!active)
+    {
+        throw SQLException("Transaction not active");
+    }
+
+    execute("COMMIT");
+    active = false;
+}
+
+void Transaction::rollback()
+{
+    if(!active) return;
+
+    active = false;
+    execute("ROLLBACK");
+}
+
+void Transaction::savepoint(const std::string& name)
+{
+    execute("SAVEPOINT " + name);
+}
+
+void Transaction::release(const std::string& name)
+{
+    execute("RELEASE " + name);
+}
+
+void Transaction::rollbackTo(const std::string& name)
+{
+    execute("ROLLBACK TO " + name);
+}
+
+bool Transaction::isActive() const
+{
+    return active;
+}
+
+void Transaction::execute(const std::string& query)
+{
+    std::shared_ptr<Statement> statement = Database::getInstance().createStatement(query);
+
+    statement->prepare();
+    statement->step();
+}